@@ -0,0 +1,162 @@
+#include <sys/file.h> // for flock(2) on linux
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Host-wide admission control for cmd starts.
+ *
+ * All fsv instances of a uid share the file `.admit' in their fsvdir.
+ * It holds the start schedule: the earliest time the next start may
+ * happen, and the interval between starts.
+ * Each start reserves the next free slot under flock(2), so starts are
+ * spread out at the configured rate and served in the order they asked,
+ * while up to `burst' of them may go right away after a quiet period.
+ *
+ * Times are CLOCK_MONOTONIC, which is the same for all processes.
+ * It starts over at boot while the file stays, so the schedule carries
+ * the boot id and a schedule from another boot counts as fresh.
+ */
+
+struct admit_sched {
+	// nanoseconds
+	int64_t next;
+	int64_t interval;
+	char boot[40];
+};
+
+static char boot_id[40];
+
+static int64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+admit_read(int fd, struct admit_sched *as)
+{
+	memset(as, 0, sizeof(*as));
+	// an empty file is a fresh schedule
+	if (pread(fd, as, sizeof(*as), 0) == -1)
+		return -1;
+	if (strncmp(as->boot, boot_id, sizeof(as->boot)) != 0) {
+		memset(as, 0, sizeof(*as));
+		memcpy(as->boot, boot_id, sizeof(as->boot));
+	}
+	return 0;
+}
+
+/*
+ * Read the boot id, if there is one; without, it stays empty.
+ */
+static void
+admit_boot_id()
+{
+	FILE *fp;
+
+	if (boot_id[0] != '\0')
+		return;
+	fp = fopen("/proc/sys/kernel/random/boot_id", "re");
+	if (fp == NULL)
+		return;
+	if (fgets(boot_id, sizeof(boot_id), fp) == NULL)
+		boot_id[0] = '\0';
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+	fclose(fp);
+}
+
+/*
+ * Open the schedule in the current directory.
+ */
+int
+admit_open()
+{
+	int fd = open(".admit", O_CREAT|O_RDWR|O_CLOEXEC, 00600);
+
+	admit_boot_id();
+	if (fd == -1)
+		slog(LOG_ERR, "open(.admit) failed: %m");
+	return fd;
+}
+
+/*
+ * Reserve a slot for one start.
+ * Returns how many nanoseconds to wait before starting, 0 to go ahead.
+ * If the schedule can't be used, fail open and go ahead.
+ */
+long long
+admit_reserve(int fd, long rate, long burst)
+{
+	struct admit_sched as;
+	int64_t now, slot;
+
+	if (flock(fd, LOCK_EX) == -1) {
+		slog(LOG_WARNING, "flock(.admit) failed: %m");
+		return 0;
+	}
+
+	if (admit_read(fd, &as) == -1) {
+		slog(LOG_WARNING, "read from .admit failed: %m");
+		flock(fd, LOCK_UN);
+		return 0;
+	}
+
+	now = now_ns();
+	as.interval = 1000000000 / rate;
+
+	// after a quiet period, allow a burst, but no more
+	slot = as.next;
+	if (slot < now - (burst - 1) * as.interval)
+		slot = now - (burst - 1) * as.interval;
+	// no sane schedule is an hour out, e.g. a damaged file
+	if (slot > now + 3600LL * 1000000000)
+		slot = now;
+
+	as.next = slot + as.interval;
+
+	if (pwrite(fd, &as, sizeof(as), 0) != sizeof(as))
+		slog(LOG_WARNING, "write into .admit failed: %m");
+	flock(fd, LOCK_UN);
+
+	return (slot > now) ? slot - now : 0;
+}
+
+/*
+ * How many starts are queued host-wide, for status.
+ * Arg `path': the admit file.
+ */
+long
+admit_queued(const char *path)
+{
+	struct admit_sched as;
+	int64_t now;
+	int fd;
+
+	admit_boot_id();
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	flock(fd, LOCK_SH);
+	admit_read(fd, &as);
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	// the last slot handed out is as.next - as.interval,
+	// and those before it are one interval apart
+	now = now_ns();
+	if (as.interval == 0 || as.next - as.interval <= now)
+		return 0;
+	return (as.next - now - 1) / as.interval;
+}
@@ -0,0 +1,187 @@
+#!/bin/sh
+#
+# Scale benchmark: start N fsv instances supervising a no-op service,
+# measure what they cost, then stop them.
+#
+# usage: scale.sh [-f fsv] [-n count] [-o report] [-p prefix]
+#
+# The report is plain `key: value' lines, one measurement per line,
+# so that two reports can be compared with diff(1).
+# Linux only, since it reads /proc.
+#
+
+set -u
+
+FSV=fsv
+N=1000
+OUT=-
+PREFIX=scale
+# the no-op service
+CMD="sleep 2147483647"
+
+while getopts f:n:o:p: ch; do
+	case $ch in
+	f) FSV=$OPTARG ;;
+	n) N=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	p) PREFIX=$OPTARG ;;
+	*) echo "usage: scale.sh [-f fsv] [-n count] [-o report] [-p prefix]" >&2
+	   exit 64 ;;
+	esac
+done
+
+# must match FSV_STATE_PREFIX
+STATE=${FSV_STATE_PREFIX:-/tmp}/fsv-$(id -u)
+
+now() {
+	date +%s.%N
+}
+
+# elapsed seconds since $1, with millisecond precision
+since() {
+	echo "$1 $(now)" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+memavail() {
+	awk '/^MemAvailable:/ { print $2 }' /proc/meminfo
+}
+
+# pids of all fsv instances of this run, one per line
+fsv_pids() {
+	i=1
+	while [ $i -le $N ]; do
+		p=$("$FSV" -p $PREFIX-$i 2>/dev/null | head -1)
+		[ -n "$p" ] && [ "$p" -gt 0 ] && echo $p
+		i=$((i + 1))
+	done
+}
+
+# sum of a /proc/PID/FILE field over all pids on stdin, in KiB
+sum_field() {
+	while read p; do
+		cat /proc/$p/$1 2>/dev/null
+	done | awk -v k="$2" '$1 == k { s += $2 } END { print s + 0 }'
+}
+
+# each instance is two processes
+maxproc=$(awk '/^Max processes/ { print $3 }' /proc/self/limits)
+if [ "$maxproc" != unlimited ] && [ "$maxproc" -lt $((N * 2 + 100)) ]; then
+	echo "scale.sh: the process limit is too low for $N instances" >&2
+	exit 1
+fi
+
+mem0=$(memavail)
+dirents0=$(ls -f "$STATE" 2>/dev/null | wc -l)
+
+#
+# Start them all, and wait until every cmd is running.
+#
+
+t0=$(now)
+i=1
+while [ $i -le $N ]; do
+	"$FSV" -b -n $PREFIX-$i $CMD || exit 1
+	i=$((i + 1))
+done
+t_spawn=$(since $t0)
+
+pending=$N
+while [ $pending -gt 0 ]; do
+	pending=0
+	i=1
+	while [ $i -le $N ]; do
+		c=$("$FSV" -p $PREFIX-$i 2>/dev/null | sed -n 2p)
+		[ -n "$c" ] && [ "$c" -gt 0 ] || pending=$((pending + 1))
+		i=$((i + 1))
+	done
+done
+t_start=$(since $t0)
+
+#
+# What do they cost?
+#
+
+pids=$(fsv_pids)
+mem1=$(memavail)
+rss=$(echo "$pids" | sum_field status VmRSS:)
+pss=$(echo "$pids" | sum_field smaps_rollup Pss:)
+fds=$(for p in $pids; do ls /proc/$p/fd; done | wc -l)
+timers=$(for p in $pids; do cat /proc/$p/timers 2>/dev/null; done |
+    grep -c '^ID:')
+threads=$(echo "$pids" | sum_field status Threads:)
+dirents=$(ls -f "$STATE" | wc -l)
+
+#
+# Bulk status.
+#
+
+t0=$(now)
+i=1
+while [ $i -le $N ]; do
+	"$FSV" -s $PREFIX-$i >/dev/null
+	i=$((i + 1))
+done
+t_status=$(since $t0)
+
+t0=$(now)
+i=1
+while [ $i -le $N ]; do
+	"$FSV" -S $PREFIX-$i
+	i=$((i + 1))
+done
+t_statusexit=$(since $t0)
+
+#
+# Tear down, and wait until all are gone.
+#
+
+t0=$(now)
+kill $pids
+for p in $pids; do
+	while kill -0 $p 2>/dev/null; do
+		sleep 0.01
+	done
+done
+t_stop=$(since $t0)
+
+i=1
+while [ $i -le $N ]; do
+	rm -rf "$STATE/$PREFIX-$i"
+	i=$((i + 1))
+done
+
+#
+# Report.
+#
+
+per() {
+	echo "$1 $N" | awk '{ printf "%.1f", $1 / $2 }'
+}
+
+{
+	echo "# fsv scale report"
+	echo "date: $(date -u +%FT%TZ)"
+	echo "fsv: $("$FSV" -V)"
+	echo "commit: $(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+	echo "kernel: $(uname -sr)"
+	echo "cpus: $(nproc)"
+	echo "instances: $N"
+	echo "cmd: $CMD"
+	echo "spawn_secs: $t_spawn"
+	echo "start_secs: $t_start"
+	echo "start_us_per_instance: $(echo "$t_start $N" | awk '{ printf "%.0f", $1 * 1000000 / $2 }')"
+	echo "rss_kib: $rss"
+	echo "rss_kib_per_instance: $(per $rss)"
+	echo "pss_kib: $pss"
+	echo "pss_kib_per_instance: $(per $pss)"
+	echo "memavailable_drop_kib: $((mem0 - mem1))"
+	echo "memavailable_drop_kib_per_instance: $(per $((mem0 - mem1)))"
+	echo "fds: $fds"
+	echo "fds_per_instance: $(per $fds)"
+	echo "threads: $threads"
+	echo "posix_timers: $timers"
+	echo "fsvdir_entries: $((dirents - dirents0))"
+	echo "status_secs: $t_status"
+	echo "status_exit_secs: $t_statusexit"
+	echo "stop_secs: $t_stop"
+} | if [ "$OUT" = - ]; then cat; else tee "$OUT"; fi
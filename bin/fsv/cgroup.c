@@ -0,0 +1,347 @@
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <fsvstat.h>
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * cgroup v2 support.
+ *
+ * With --cgroup, cmd runs in a cgroup of its own, `fsv-UID.NAME', created
+ * next to fsv in fsv's own cgroup. That makes it possible to freeze and
+ * thaw cmd together with everything it started, which SIGSTOP can't do.
+ *
+ * fsv freezes cmd on SIGTSTP and thaws it on SIGCONT; fsv --freeze and
+ * fsv --thaw send those and wait for the freezer to finish.
+ *
+ * fsv removes the cgroup when it exits, once it is empty.
+ */
+
+// how long --freeze waits for the cgroup to be frozen, in ms
+#define CG_WAIT	5000
+// how long fsv waits on exit for the cgroup to empty, in ms
+#define CG_REAP_MS	1000
+
+// cgroup.procs and cgroup.freeze of cmd's cgroup
+static int cg_procs = -1;
+static int cg_freezer = -1;
+// cpu.stat and memory.current, -1 if the controller isn't there
+static int cg_cpu = -1;
+static int cg_mem = -1;
+// its directory, to remove on exit
+static char *cg_dir = NULL;
+
+static int cg_event(const char *, const char *);
+
+/*
+ * Find where cgroup v2 is mounted: /sys/fs/cgroup when it is the only
+ * hierarchy, or /sys/fs/cgroup/unified next to v1 ones.
+ */
+static const char *
+cg_mount()
+{
+#ifdef __linux__
+	if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0)
+		return "/sys/fs/cgroup";
+	if (access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0)
+		return "/sys/fs/cgroup/unified";
+#endif
+	return NULL;
+}
+
+/*
+ * Put the directory of the cgroup v2 of `pid' (0 for fsv itself)
+ * into `dir'. Returns -1 if there isn't one.
+ */
+int
+cg_path(pid_t pid, char *dir, size_t len)
+{
+	const char *mnt = cg_mount();
+	char path[64];
+	char line[256];
+	int r = -1;
+	FILE *f;
+
+	if (mnt == NULL)
+		return -1;
+
+	if (pid == 0)
+		strcpy(path, "/proc/self/cgroup");
+	else
+		snprintf(path, sizeof(path), "/proc/%ld/cgroup", (long)pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	// the cgroup v2 entry looks like "0::/path"
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "0::", 3) != 0)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		// no double slash for the root
+		if (snprintf(dir, len, "%s%s", mnt,
+		    strcmp(line + 3, "/") == 0 ? "" : line + 3) < len)
+			r = 0;
+		break;
+	}
+	fclose(f);
+	return r;
+}
+
+/*
+ * Create cmd's cgroup and get ready to move cmd into it.
+ * A cgroup left frozen by an earlier fsv is thawed.
+ */
+int
+cg_open(const char *name)
+{
+	char dir[512];
+	char *path;
+	int fd;
+
+	if (cg_path(0, dir, sizeof(dir)) == -1) {
+		slog(LOG_ERR, "no cgroup v2 hierarchy found");
+		return -1;
+	}
+
+	if (asprintf(&path, "%s/fsv-%ld.%s", dir, (long)geteuid(), name)
+	    == -1) {
+		slog(LOG_ERR, "asprintf: %m");
+		return -1;
+	}
+	if (mkdir(path, 00755) == -1 && errno != EEXIST) {
+		slog(LOG_ERR, "mkdir(%s) failed: %m", path);
+		return -1;
+	}
+	fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		slog(LOG_ERR, "open(%s) failed: %m", path);
+		return -1;
+	}
+	slog(LOG_DEBUG, "cmd cgroup: %s", path);
+	cg_dir = path;
+
+	cg_procs = openat(fd, "cgroup.procs", O_WRONLY|O_CLOEXEC);
+	if (cg_procs == -1) {
+		slog(LOG_ERR, "open(cgroup.procs) failed: %m");
+		close(fd);
+		return -1;
+	}
+	cg_freezer = openat(fd, "cgroup.freeze", O_WRONLY|O_CLOEXEC);
+	// only for --sample, so these may be missing
+	cg_cpu = openat(fd, "cpu.stat", O_RDONLY|O_CLOEXEC);
+	cg_mem = openat(fd, "memory.current", O_RDONLY|O_CLOEXEC);
+	close(fd);
+	if (cg_freezer == -1) {
+		slog(LOG_ERR, "open(cgroup.freeze) failed: %m");
+		return -1;
+	}
+
+	return cg_freeze(0);
+}
+
+/*
+ * In a cmd child, before exec: move into cmd's cgroup.
+ * Only uses write(2), so is safe to call after fork().
+ * If that fails, cmd runs where it is and simply can't be frozen.
+ */
+void
+cg_enter()
+{
+	if (cg_procs == -1)
+		return;
+	// "0" means the writing process
+	write(cg_procs, "0", 1);
+}
+
+/*
+ * Freeze or thaw cmd's cgroup.
+ * Freezing finishes in the background; cgroup.events shows when.
+ */
+int
+cg_freeze(int on)
+{
+	if (cg_freezer == -1)
+		return -1;
+	if (pwrite(cg_freezer, on ? "1" : "0", 1, 0) != 1) {
+		slog(LOG_ERR, "write into cgroup.freeze failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the CPU time used by everything in cmd's cgroup so far, in ns,
+ * and the memory it uses now, in bytes, or -1 if unknown.
+ * Returns -1 if there is no cgroup to read from.
+ */
+int
+cg_usage(long long *cpu_ns, long long *mem)
+{
+	char buf[512];
+	char *c;
+	ssize_t r;
+
+	if (cg_cpu == -1)
+		return -1;
+	r = pread(cg_cpu, buf, sizeof(buf) - 1, 0);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+	// the first line is "usage_usec N"
+	c = strstr(buf, "usage_usec ");
+	if (c == NULL)
+		return -1;
+	*cpu_ns = strtoll(c + 11, NULL, 10) * 1000;
+
+	*mem = -1;
+	if (cg_mem != -1 && (r = pread(cg_mem, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[r] = '\0';
+		*mem = strtoll(buf, NULL, 10);
+	}
+	return 0;
+}
+
+/*
+ * On exit: thaw cmd's cgroup, wait a little for cmd, which has been told
+ * to stop, and whatever it started to leave it, and remove it.
+ * Reaps children while waiting.
+ */
+void
+cg_close()
+{
+	if (cg_dir == NULL)
+		return;
+
+	cg_freeze(0);
+	for (int ms=0; ms < CG_REAP_MS; ms += 10) {
+		struct timespec ts = { 0, 10000000 };
+
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		if (cg_event(cg_dir, "populated") == 0)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	// still busy means something in it outlives fsv; leave it be
+	if (rmdir(cg_dir) == -1) {
+		if (errno == EBUSY)
+			slog(LOG_DEBUG, "cgroup %s still in use", cg_dir);
+		else
+			slog(LOG_WARNING, "rmdir(%s) failed: %m", cg_dir);
+	}
+	free(cg_dir);
+	cg_dir = NULL;
+}
+
+/*
+ * Read the key `key' of cgroup.events in `dir'; -1 on error.
+ */
+static int
+cg_event(const char *dir, const char *key)
+{
+	char path[600];
+	char line[64];
+	int val = -1;
+	FILE *f;
+	size_t n = strlen(key);
+
+	snprintf(path, sizeof(path), "%s/cgroup.events", dir);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, key, n) == 0 && line[n] == ' ' &&
+		    sscanf(line + n + 1, "%d", &val) == 1)
+			break;
+	}
+	fclose(f);
+	return val;
+}
+
+/*
+ * Kill everything in the cgroup in `dir' at once, with cgroup.kill.
+ * Returns -1 if that fails, as it does before Linux 5.14.
+ */
+int
+cg_kill(const char *dir)
+{
+	char path[600];
+	int fd, r;
+
+	snprintf(path, sizeof(path), "%s/cgroup.kill", dir);
+	fd = open(path, O_WRONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	r = write(fd, "1", 1) == 1 ? 0 : -1;
+	close(fd);
+	return r;
+}
+
+/*
+ * For --freeze and --thaw: ask the fsv with the given name to freeze
+ * (`on' true) or thaw cmd, and wait until it is done.
+ * This function does not return, and instead calls exit(3).
+ */
+void
+cg_control(uid_t u, char *name, int on)
+{
+	struct allinfo ai;
+	fsvstat *h;
+
+	h = fsvstat_open(u, name);
+	if (h == NULL) {
+		slog(LOG_ERR, "open(info.struct) failed: %m");
+		exit(1);
+	}
+	if (fsvstat_raw(h, &ai, sizeof(ai)) == -1) {
+		if (errno == EPROTO)
+			slog(LOG_ERR, "unexpected data in info.struct");
+		else
+			slog(LOG_ERR, "read from info.struct failed: %m");
+		exit(1);
+	}
+	fsvstat_close(h);
+
+	if (ai.fsv.pid <= 0 || !status_running(u, name)) {
+		slog(LOG_ERR, "%s is not running", name);
+		exit(1);
+	}
+	if (!ai.fsv.cgroup) {
+		slog(LOG_ERR, "%s was not started with --cgroup", name);
+		exit(1);
+	}
+	if (kill(ai.fsv.pid, on ? SIGTSTP : SIGCONT) == -1) {
+		slog(LOG_ERR, "kill(%ld) failed: %m", (long)ai.fsv.pid);
+		exit(1);
+	}
+
+	// thawing takes effect right away; nothing to wait for
+	if (!on || ai.chld[0].pid <= 0)
+		exit(0);
+
+	char dir[512];
+	if (cg_path(ai.chld[0].pid, dir, sizeof(dir)) == -1)
+		exit(0);
+	for (int i=0; i<CG_WAIT/10; i++) {
+		if (cg_event(dir, "frozen") == 1)
+			exit(0);
+		struct timespec ts = { 0, 10000000 };
+		nanosleep(&ts, NULL);
+	}
+	slog(LOG_ERR, "%s did not freeze within %d ms", name, CG_WAIT);
+	exit(1);
+}
@@ -0,0 +1,360 @@
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * The binaries of cmd and log.
+ *
+ * Each is looked up in PATH once, and kept open; every start then execs
+ * that very file with fexecve(3), so what runs can't change behind fsv's
+ * back, and PATH isn't searched again.
+ *
+ * The path it was found at is watched with inotify. When another file
+ * shows up there, as it does in a deploy, it is noted in info.struct, and,
+ * unless --on-change keep was given, picked up at the next start.
+ * A binary written over in place is the same file, so what is open
+ * changes with it; it can't be kept, and is treated as new. Neither can
+ * a script, which runs by path since its interpreter opens it by name.
+ *
+ * If the binary can't be found, exec falls back to execvp(3), and it is
+ * looked up again at the next start.
+ */
+
+extern char **environ;
+
+// the lowest fd to keep a binary open on
+#define EXE_FD_MIN	100
+
+// kept open for fexecve(), -1 for none, and where they were found
+static int exe_fd[2] = { -1, -1 };
+static const char *exe_path[2];
+// true if it is a script, which runs by path
+static int exe_script[2];
+// true to keep running the old binary when the path changes
+static int exe_keep;
+
+#ifdef __linux__
+static int ino_fd = -1;
+// watches on the directories holding the binaries
+static int ino_wd[2] = { -1, -1 };
+#endif
+
+/*
+ * Find `file' like execvp(3) would, putting an absolute path into `path'.
+ */
+static int
+exe_find(const char *file, char *path, size_t len)
+{
+	const char *p, *end;
+	struct stat st;
+
+	if (strchr(file, '/') != NULL) {
+		// relative to where fsv was started, not its state directory
+		if (*file != '/') {
+			char cwd[PATH_MAX];
+			while (strncmp(file, "./", 2) == 0)
+				file += 2;
+			if (getcwd(cwd, sizeof(cwd)) == NULL)
+				return -1;
+			if (snprintf(path, len, "%s/%s", cwd, file) >= len)
+				return -1;
+		} else if (snprintf(path, len, "%s", file) >= len) {
+			return -1;
+		}
+		return access(path, X_OK);
+	}
+
+	p = getenv("PATH");
+	if (p == NULL)
+		p = "/bin:/usr/bin";
+	for (; ; p = end + 1) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		// an empty element is the current directory
+		if (snprintf(path, len, "%.*s%s%s", (int)(end - p), p,
+		    end == p ? "" : "/", file) < len &&
+		    *path == '/' && stat(path, &st) == 0 &&
+		    S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			return 0;
+		if (*end == '\0')
+			break;
+	}
+	return -1;
+}
+
+/*
+ * True if the file at `path' starts with "#!".
+ */
+static int
+exe_is_script(const char *path)
+{
+	char magic[2];
+	int fd, r;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	r = read(fd, magic, 2) == 2 && magic[0] == '#' && magic[1] == '!';
+	close(fd);
+	return r;
+}
+
+/*
+ * Open the binary at e->path and record what it is.
+ */
+static int
+exe_load(int which, struct fsv_exe *e)
+{
+	struct stat st;
+	int fd;
+
+#ifdef O_PATH
+	fd = open(e->path, O_PATH|O_CLOEXEC);
+#else
+	fd = open(e->path, O_RDONLY|O_CLOEXEC);
+#endif
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	exe_script[which] = exe_is_script(e->path);
+	if (exe_script[which] && exe_keep)
+		slog(LOG_WARNING, "%s is a script, which runs by path; "
+		    "it can't be kept as it is", e->path);
+	// out of the way of the fds a child is given, like --ready-fd
+	if (fd < EXE_FD_MIN) {
+		int hi = fcntl(fd, F_DUPFD_CLOEXEC, EXE_FD_MIN);
+		if (hi != -1) {
+			close(fd);
+			fd = hi;
+		}
+	}
+
+	if (exe_fd[which] != -1)
+		close(exe_fd[which]);
+	exe_fd[which] = fd;
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->mtime = st.st_mtim;
+	e->size = st.st_size;
+	e->changed = 0;
+	return 0;
+}
+
+/*
+ * Look up and open the binary for `file'.
+ */
+static int
+exe_lookup(int which, struct fsv_exe *e, const char *file)
+{
+	exe_path[which] = e->path;
+	if (exe_find(file, e->path, sizeof(e->path)) == -1 ||
+	    exe_load(which, e) == -1) {
+		e->path[0] = '\0';
+		return -1;
+	}
+	slog(LOG_DEBUG, "%s is %s", file, e->path);
+	return 0;
+}
+
+/*
+ * Watch the directory the binary is in.
+ */
+static void
+exe_add_watch(int which, const struct fsv_exe *e)
+{
+#ifdef __linux__
+	char dir[sizeof(e->path)];
+
+	if (ino_fd == -1 || ino_wd[which] != -1 || e->path[0] == '\0')
+		return;
+	strcpy(dir, e->path);
+	*strrchr(dir, '/') = '\0';
+	// a file can be replaced by writing over it, or by renaming
+	// another one into place
+	ino_wd[which] = inotify_add_watch(ino_fd, dir[0] ? dir : "/",
+	    IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|
+	    IN_MOVED_TO);
+	if (ino_wd[which] == -1)
+		slog(LOG_WARNING, "inotify_add_watch(%s) failed: %m", dir);
+#endif
+}
+
+/*
+ * Look up and open the binary for `file', cmd's or log's argv[0].
+ * `keep' is the --on-change policy.
+ */
+void
+exe_open(int which, struct fsv_exe *e, const char *file, int keep)
+{
+	exe_keep = keep;
+	if (exe_lookup(which, e, file) == -1)
+		slog(LOG_WARNING, "%s not found, will look for it at each start",
+		    file);
+}
+
+/*
+ * Watch the paths of the binaries for changes; they come as SIGIO.
+ * Must be called after daemon(), for F_SETOWN.
+ */
+void
+exe_watch(struct fsv_child chld[])
+{
+#ifdef __linux__
+	ino_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (ino_fd == -1) {
+		slog(LOG_WARNING, "inotify_init1() failed: %m");
+		return;
+	}
+	fcntl(ino_fd, F_SETOWN, getpid());
+	fcntl(ino_fd, F_SETFL, O_NONBLOCK|O_ASYNC);
+	for (int i=0; i<2; i++)
+		exe_add_watch(i, &chld[i].exe);
+#endif
+}
+
+/*
+ * True if the file at e->path isn't the binary that is open.
+ */
+static int
+exe_differs(const struct fsv_exe *e)
+{
+	struct stat st;
+
+	if (stat(e->path, &st) == -1)
+		return 1;
+	return st.st_dev != e->dev || st.st_ino != e->ino ||
+	    st.st_mtim.tv_sec != e->mtime.tv_sec ||
+	    st.st_mtim.tv_nsec != e->mtime.tv_nsec || st.st_size != e->size;
+}
+
+/*
+ * True if the binary that is open was written over in place: the same
+ * file, but with other contents.
+ */
+static int
+exe_inplace(const struct fsv_exe *e)
+{
+	struct stat st;
+
+	if (stat(e->path, &st) == -1)
+		return 0;
+	return st.st_dev == e->dev && st.st_ino == e->ino && exe_differs(e);
+}
+
+/*
+ * True if what runs at the next start is what is at the path now,
+ * whatever --on-change says.
+ */
+static int
+exe_follows(int which, const struct fsv_exe *e)
+{
+	return exe_script[which] || exe_inplace(e);
+}
+
+/*
+ * On SIGIO: see if either binary changed.
+ * Returns true if `chld' was updated.
+ */
+int
+exe_check(struct fsv_child chld[])
+{
+#ifdef __linux__
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	ssize_t r;
+
+	if (ino_fd == -1)
+		return 0;
+
+	// the events only say where to look
+	while ((r = read(ino_fd, buf, sizeof(buf))) > 0)
+		;
+
+	for (int i=0; i<2; i++) {
+		struct fsv_exe *e = &chld[i].exe;
+
+		if (ino_wd[i] == -1 || e->changed || !exe_differs(e))
+			continue;
+		e->changed = 1;
+		changed = 1;
+		if (exe_keep && exe_follows(i, e))
+			slog(LOG_WARNING, "%s %s; can't keep the old binary, "
+			    "will use it at the next start", e->path,
+			    exe_script[i] ? "changed" :
+			    "was written over in place");
+		else
+			slog(LOG_NOTICE, "%s changed; %s", e->path, exe_keep ?
+			    "keeping the old binary" :
+			    "will use it at the next start");
+	}
+	return changed;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Before starting cmd or log: open the binary again if it changed,
+ * or if it wasn't there before.
+ * Returns true if a different binary will run from now on.
+ */
+int
+exe_refresh(int which, struct fsv_exe *e, const char *file)
+{
+	if (file == NULL)
+		return 0;
+	if (e->path[0] == '\0') {
+		if (exe_lookup(which, e, file) == -1)
+			return 0;
+		exe_add_watch(which, e);
+		return 1;
+	}
+	if (!exe_differs(e) || (exe_keep && !exe_follows(which, e)))
+		return 0;
+	if (exe_load(which, e) == -1) {
+		slog(LOG_WARNING, "%s is gone; keeping the old binary",
+		    e->path);
+		return 0;
+	}
+	slog(LOG_NOTICE, "starting %s with the new %s",
+	    which == 0 ? "cmd" : "log", e->path);
+	return 1;
+}
+
+/*
+ * In a child: exec the binary that is open, if any.
+ * Returns only on failure, like exec.
+ */
+void
+exe_exec(int which, char *argv[])
+{
+	if (exe_fd[which] == -1) {
+		execvp(argv[0], argv);
+		return;
+	}
+	// A script's interpreter would get it as /dev/fd/N, which
+	// is what $0 would be, so it runs by path instead.
+	if (exe_script[which])
+		execv(exe_path[which], argv);
+	else
+		fexecve(exe_fd[which], argv, environ);
+}
@@ -7,7 +7,47 @@
 #define FSV_STATE_PREFIX "/tmp"
 #endif
 
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <pthread.h>
 #include <signal.h>
+#include <time.h>
+
+// records in the log store are at most this long;
+// longer lines are split
+#define SINK_LINE_MAX 4096
+
+// latency histograms have log-scale buckets:
+// bucket 0 counts anything under 2 us, bucket i [2^i, 2^(i+1)) us,
+// and the last one also everything longer
+#define HIST_BUCKETS 24
+
+struct fsv_hist {
+	long long count;
+	long long sum_us;
+	long long max_us;
+	long long bucket[HIST_BUCKETS];
+};
+
+// on-demand states, with --listen
+#define OD_OFF		0
+#define OD_IDLE		1
+#define OD_STARTING	2
+#define OD_ACTIVE	3
+
+// what fsv --replace sends to ask for a replace; a realtime signal,
+// since the classic ones already mean something to a process
+#define SIGREPLACE	(SIGRTMIN + 0)
+
+// steps of replacing cmd, with --replace
+#define REP_NONE	0
+// the new cmd is starting alongside the old one
+#define REP_STARTING	1
+// the new cmd is up and the old one was told to stop
+#define REP_STOPPING	2
+// the new cmd didn't come up and is being stopped
+#define REP_ABORTING	3
 
 struct fsv_parent {
 	// PID is 0 if not running
@@ -22,6 +62,98 @@ struct fsv_parent {
 
 	// configuration
 	long timeout;
+	// true if cmd runs in a cgroup of its own
+	int cgroup;
+	// true to keep running the old binaries when they change on disk
+	int exe_keep;
+	// --admit-rate, 0 without admission control
+	long admit_rate;
+	// --log-async, 0 without, and the messages it dropped
+	long slog_slots;
+	unsigned long long slog_dropped;
+
+	// on-demand mode: OD_*, and seconds without connections to stop
+	// cmd after, 0 for never
+	int od_state;
+	long od_idle;
+	long od_activations;
+	long od_idle_stops;
+	// from a connection waiting to cmd being up
+	struct fsv_hist od_latency;
+
+	// replacing cmd: REP_*, the old cmd process while both run, and
+	// since when
+	int rep_state;
+	pid_t rep_old;
+	struct timespec rep_since;
+	long replaces;
+	long rep_aborts;
+	// how long both ran, from starting the new one to reaping the old
+	struct fsv_hist rep_overlap;
+};
+
+// how a child last ended
+#define EXIT_NONE	0
+// it couldn't be executed
+#define EXIT_EXEC	1
+#define EXIT_CODE	2
+#define EXIT_SIGNAL	3
+
+// what to do about cmd ending, by how it did, with --on-exit
+#define POL_RESTART	0
+// restart without counting against max_recent_execs
+#define POL_NOW		1
+// cmd is done; fsv exits
+#define POL_DONE	2
+// as if max_recent_execs were exceeded
+#define POL_GIVEUP	3
+
+// the binary a child is run from; see exe.c
+struct fsv_exe {
+	// where it was found; empty if it wasn't
+	char path[256];
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+	// true if another file is at path now
+	int changed;
+};
+
+// memory policy for cmd; see mempol.c
+struct fsv_mem {
+	int thp_disable;
+	int ksm;
+	// --numa as given, like "interleave:0-1"; empty for none
+	char numa[32];
+	// RLIMIT_MEMLOCK, if memlock is true; -1 for unlimited
+	int memlock;
+	long long memlock_kib;
+};
+
+// live CPU and memory use of cmd, with --sample; see sample.c
+struct fsv_usage {
+	// configuration: seconds between samples, 0 for none, and
+	// true to count the descendants of cmd too
+	long interval;
+	int tree;
+
+	long long samples;
+	// CPU in percent of one CPU and memory in KiB: the last sample,
+	// the moving average over about a minute, and the peak
+	double cpu;
+	double cpu_avg;
+	double cpu_peak;
+	long long mem_kib;
+	double mem_avg_kib;
+	long long mem_peak_kib;
+	// processes counted in the last sample
+	int nprocs;
+
+	// the last totals, for the next delta
+	pid_t pid;
+	long long cpu_ns;
+	struct timespec at;
 };
 
 struct fsv_child {
@@ -33,15 +165,118 @@ struct fsv_child {
 	// tracking
 	long total_execs;
 	long recent_execs;
+	// true while a start is waiting for host-wide admission
+	int queued;
+	// true while frozen by the cgroup freezer
+	int frozen;
+	// true once cmd has said that it is ready, with --ready-fd
+	int ready;
+	// with --subreaper, the pid fsv started if it is now following
+	// another process that it forked; 0 otherwise
+	pid_t started_as;
+	// true while a start is held off by resource pressure, and why;
+	// the reason of the last deferral is kept after it is started
+	int deferred;
+	long deferrals;
+	char defer_reason[64];
+	// how it last ended, EXIT_*, with the exit code or signal, and
+	// what was done about it, POL_*; how often it ended each way
+	int last_reason;
+	int last_code;
+	int last_action;
+	long exec_fails;
+	long exits_ok;
+	long exits_err;
+	long exits_sig;
 
 	// configuration
 	long max_recent_execs;
 	long recent_secs;
+	// fd cmd writes a newline to once it is ready, 0 for none
+	int ready_fd;
+	struct fsv_mem mem;
+
+	struct fsv_exe exe;
+	struct fsv_usage usage;
+
+	// how long it takes to come back: from SIGCHLD to reaping it,
+	// from that to fork(), from fork() to a successful exec,
+	// and from exec to ready
+	struct fsv_hist exit_reap;
+	struct fsv_hist reap_fork;
+	struct fsv_hist fork_exec;
+	struct fsv_hist exec_ready;
+};
+
+// log store, if enabled with -w
+struct fsv_store {
+	// configuration
+	int enabled;
+	int compress;
+
+	// tracking, for compression of closed segments
+	long z_segs;
+	long long z_in;
+	long long z_out;
+	// CPU time spent by the compressor thread
+	struct timespec z_cpu;
+};
+
+// forwarding to a collector, with --forward
+struct fsv_fwd {
+	// configuration
+	int enabled;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	long buffer_kib;
+
+	// tracking
+	int connected;
+	// whether it is a datagram socket rather than a stream
+	int dgram;
+	long long connects;
+	// errno of the last failure to connect or send
+	int last_errno;
+	// records sent in full, in how many sends, and bytes
+	long long lines;
+	long long batches;
+	long long bytes;
+	// bytes waiting to be sent, and the most there ever were
+	long long buffered;
+	long long buffered_peak;
+	// times the collector didn't take all that was sent
+	long long stalls;
+	// lines that found the buffer full, or were left over at exit
+	long long dropped;
+};
+
+// the sink, if fsv is looking at the output of cmd
+struct fsv_sink {
+	// configuration
+	int enabled;
+	long rate_lines;
+	long rate_bytes;
+	int collapse;
+
+	// tracking
+	long long lines;
+	// lines dropped by the rate limit
+	long long dropped;
+	// lines collapsed as repeats of the one before
+	long long suppressed;
+
+	// bytes waiting for log, in memory or the spill file
+	long long backlog;
+	// bytes that ever went to the spill file
+	long long spilled;
+
+	struct fsv_fwd fwd;
 };
 
 struct allinfo {
 	struct fsv_parent fsv;
 	struct fsv_child chld[2];
+	struct fsv_store store;
+	struct fsv_sink sink;
 };
 
 // file descriptor to /dev/null
@@ -50,9 +285,178 @@ extern int fd_devnull;
 // signal block mask
 extern sigset_t bmask;
 
+// held while writing info.struct and touching the shared parts of it,
+// which threads other than main may update
+extern pthread_mutex_t info_mtx;
+
+/*
+ * admit.c
+ */
+int admit_open();
+long long admit_reserve(int, long, long);
+long admit_queued(const char *);
+
+/*
+ * cgroup.c
+ */
+int cg_path(pid_t, char *, size_t);
+int cg_open(const char *);
+void cg_enter();
+void cg_close();
+int cg_freeze(int);
+int cg_kill(const char *);
+int cg_usage(long long *, long long *);
+__dead void cg_control(uid_t, char *, int);
+
+/*
+ * exe.c
+ */
+void exe_open(int, struct fsv_exe *, const char *, int);
+void exe_watch(struct fsv_child[]);
+int exe_check(struct fsv_child[]);
+int exe_refresh(int, struct fsv_exe *, const char *);
+void exe_exec(int, char *[]);
+
+/*
+ * fsv.c
+ */
+void sync_info();
+
+/*
+ * fwd.c
+ */
+int fwd_open(const char *, const char *, long);
+void fwd_append(const struct timespec *, const char *, size_t);
+int fwd_pollfd(short *);
+int fwd_timeout(const struct timespec *, int);
+int fwd_run(const struct timespec *, int);
+void fwd_stats(struct fsv_fwd *);
+void fwd_close();
+
+/*
+ * lz.c
+ */
+size_t lz_compress(const unsigned char *, size_t, unsigned char *, size_t);
+ssize_t lz_decompress(const unsigned char *, size_t, unsigned char *, size_t);
+
+/*
+ * mempol.c
+ */
+int mem_init(const struct fsv_mem *);
+int mem_apply();
+
+/*
+ * ondemand.c
+ */
+int od_listen(const char *);
+void od_arm(int);
+int od_pending(int);
+int od_busy(int);
+void od_child(int, int[]);
+
+/*
+ * policy.c
+ */
+int pol_parse(const char *);
+int pol_classify(struct fsv_child *, int, int);
+const char *pol_name(int);
+
+/*
+ * psi.c
+ */
+void psi_init();
+int psi_check(const long[3], char *, size_t);
+
+/*
+ * reaper.c
+ */
+// how often to call reaper_recheck(), in ms
+#define REAPER_POLL_MS	10
+
+int reaper_init();
+pid_t reaper_follow(const char *, int, pid_t[], int);
+pid_t reaper_recheck(const char *);
+
+/*
+ * replace.c
+ */
+__dead void replace_cmd(uid_t, char *);
+
+/*
+ * sample.c
+ */
+void smp_init(struct fsv_usage *, int);
+int smp_tick(struct fsv_usage *, pid_t);
+
+/*
+ * sink.c
+ */
+struct sinkconf {
+	// log store; see store.c
+	int store;
+	long store_kib;
+	long store_keep;
+	int store_compress;
+
+	// live tail, in KiB; 0 for none; see tail.c
+	long tail_kib;
+
+	// filtering; 0 means no limit
+	long rate_lines;
+	long rate_bytes;
+	int collapse;
+
+	// size of the in-memory backlog for log
+	long log_buffer_kib;
+
+	// collector socket, NULL for none, and the name to send as;
+	// see fwd.c
+	const char *fwd_path;
+	const char *fwd_name;
+	long fwd_kib;
+};
+
+extern struct fsv_sink sinkinfo;
+
+int sink_start(struct sinkconf *, int, int, int);
+void sink_stop(int);
+
 /*
  * status.c
  */
+int status_running(uid_t, const char *);
 void status(char, uid_t, char *);
 
+/*
+ * stop.c
+ */
+__dead void stop_all(uid_t, char *[], int, long);
+
+/*
+ * store.c
+ */
+extern struct fsv_store storeinfo;
+
+int store_open(long, long, int);
+void store_append(const struct timespec *, const char *, size_t);
+void store_flush();
+void store_close();
+__dead void store_query(uid_t, char *, time_t, time_t, long);
+time_t store_parse_time(const char *);
+
+/*
+ * svc.c
+ */
+struct option;
+
+int split_words(char *, char ***);
+int svc_load(const char *, const struct option *, char ***, int *, int);
+
+/*
+ * tail.c
+ */
+int tail_open(long);
+void tail_append(const char *, size_t);
+__dead void tail_follow(uid_t, char *, int);
+
 #endif // !_EXTERN_H_
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -18,16 +19,156 @@
 #include <slog.h>
 
 #include "extern.h"
+#include "probes.h"
 
+static __dead void chld_exec(int, int[], int[], char *[], int, int[]);
+static void chld_fds(int, int[], long, int[]);
+static char **env_build(char *[], int);
 int fork_chld(int, struct fsv_child *, int[], char *[], long);
+pid_t fork_standby(int[], char *[], long, int *, int[]);
+static void hist_add(struct fsv_hist *, const struct timespec *,
+    const struct timespec *);
+static int od_activate(struct fsv_parent *, struct fsv_child *);
+static int od_started(struct fsv_parent *, struct fsv_child *);
+static void rep_arm(long long);
+static void idle_arm(long);
+static int rep_check(struct fsv_parent *, struct fsv_child *, long, long);
+static int sig_case(int);
+static void standby_drop(pid_t *, int *, int[]);
+int start_standby(struct fsv_child *, pid_t, int, int[]);
+static int watch_check(struct fsv_child *, int);
+static void watch_close(int);
+static void watch_pipes(int, int[], int[]);
+#ifdef USE_SDT
+static long long probe_ns(const struct timespec *);
+#endif
 long str_to_l(const char *);
-void termprocs(struct fsv_child[]);
+int termprocs(struct fsv_parent *, struct fsv_child[]);
 __dead void usage();
 void write_info(int fd, struct fsv_parent *fsv, struct fsv_child chld[]);
 
 // define externs
 int fd_devnull = -1;
 sigset_t bmask;
+pthread_mutex_t info_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// the service name, for probes
+static const char *svc_name;
+
+// Read ends of the pipes that tell how far each child got since fork(),
+// -1 if closed; see watch_pipes().
+// [n][0] is for exec, [n][1] for readiness.
+static int watch[2][2] = { { -1, -1 }, { -1, -1 } };
+// when each child exec'd, for exec_ready
+static struct timespec exec_ts[2];
+// true if a child said that its exec failed
+static int exec_err[2];
+
+// --ready-fd, 0 if not given
+static int ready_fd = 0;
+
+// the environment for cmd with --env, NULL for the same as fsv's
+extern char **environ;
+static char **cmd_env = NULL;
+
+// --listen: the socket, -1 if not given; when the current activation
+// began, and when cmd last had connections
+static int listen_fd = -1;
+static struct timespec od_t0;
+static struct timespec od_busy_ts;
+// with --idle, the timer to look for connections again while cmd is
+// active, at most every OD_CHECK_MAX seconds
+static timer_t idle_tid;
+#define OD_CHECK_MAX 5
+
+// how long termprocs() waits for log to exit, in ms
+#define LOG_REAP_MS 1000
+
+// each timer has a realtime signal of its own, so that none is lost to
+// another one that is still pending
+#define SIGREPSTEP	(SIGRTMIN + 1)
+#define SIGPIDFILE	(SIGRTMIN + 2)
+#define SIGSAMPLE	(SIGRTMIN + 3)
+#define SIGIDLE		(SIGRTMIN + 4)
+
+// the realtime signals aren't constants, so the main loop switches on
+// these in their place; see sig_case()
+#define SIG_REPLACE	(-1)
+#define SIG_REPSTEP	(-2)
+#define SIG_PIDFILE	(-3)
+#define SIG_SAMPLE	(-4)
+#define SIG_IDLE	(-5)
+
+
+// --replace: cmd as it was before the new one was started, to go back
+// to; when the current step began, and the timer for its time limit
+static struct fsv_child rep_prev;
+static struct timespec rep_ts;
+static timer_t rep_tid;
+// the old cmd, still stopping after the new one died at the last step
+static pid_t rep_left = 0;
+
+// --subreaper with --pidfile: cmd exited cleanly and the pidfile doesn't
+// name its daemon yet; the process that exited and how, the timer to look
+// again, and true once the wait is over without one
+static pid_t fol_pid = 0;
+static int fol_status;
+static timer_t fol_tid;
+static int fol_over = 0;
+
+// what was last written to info.struct, for sync_info()
+static int lastinfo_fd = -1;
+static struct allinfo lastinfo;
+
+// longest wait between pressure checks while a restart is deferred
+#define PSI_DELAY_MAX 30
+
+// long options without a single-letter equivalent
+enum {
+	OPT_ADMIT_BURST = 256,
+	OPT_ADMIT_RATE,
+	OPT_CGROUP,
+	OPT_COLLAPSE,
+	OPT_COMPILE,
+	OPT_DEADLINE,
+	OPT_ENV,
+	OPT_FOLLOW,
+	OPT_FORWARD,
+	OPT_FORWARD_BUFFER,
+	OPT_FREEZE,
+	OPT_IDLE,
+	OPT_KSM,
+	OPT_LAST,
+	OPT_LISTEN,
+	OPT_LOG_ASYNC,
+	OPT_LOG_BUFFER,
+	OPT_MEMLOCK,
+	OPT_NUMA,
+	OPT_ON_CHANGE,
+	OPT_ON_EXIT,
+	OPT_PIDFILE,
+	OPT_PSI_CPU,
+	OPT_PSI_IO,
+	OPT_PSI_MEMORY,
+	OPT_RATE_BYTES,
+	OPT_RATE_LINES,
+	OPT_READY_FD,
+	OPT_REPLACE,
+	OPT_SAMPLE,
+	OPT_SAMPLE_TREE,
+	OPT_SHUTDOWN,
+	OPT_SINCE,
+	OPT_STANDBY,
+	OPT_STORE_KEEP,
+	OPT_STORE_SIZE,
+	OPT_SUBREAPER,
+	OPT_TAIL,
+	OPT_TAIL_SIZE,
+	OPT_THAW,
+	OPT_THP_DISABLE,
+	OPT_UNTIL,
+	OPT_UP_SECS,
+};
 
 int
 main(int argc, char *argv[])
@@ -61,18 +202,60 @@ main(int argc, char *argv[])
 
 	int do_daemon = 0;
 	int do_status = 0;
+	int do_standby = 0;
+	int do_subreaper = 0;
+
+	// for --subreaper; absolute, since fsv changes directory
+	char *pidfile = NULL;
+
+	// --env, as given
+	char **env_add = NULL;
+	int nenv = 0;
 
 	// -1 means we are not logging at all
 	long out_mask = -1;
 
+	// host-wide cmd starts per second, 0 for no limit
+	long admit_rate = 0;
+	long admit_burst = 0;
+
+	// pressure thresholds for restarts of cmd, in percent:
+	// cpu, memory, io; 0 for none
+	long psi_limit[3] = { 0, 0, 0 };
+
 	uid_t status_uid = -1;
 
-	const char *getopt_str = "+BbdhL:l:M:m:n:o:p:R:r:S:s:t:u:VYy";
+	struct sinkconf sc;
+	memset(&sc, 0, sizeof(sc));
+	sc.store_kib = 1024;
+	sc.store_keep = 8;
+	sc.log_buffer_kib = 256;
+	sc.fwd_kib = 256;
+
+	// for -q
+	time_t q_since = 0;
+	time_t q_until = -1;
+	long q_last = 0;
+
+	// for --tail
+	int do_follow = 0;
+
+	// for --shutdown and --replace, in seconds
+	long deadline = 10;
+
+	// for --replace: how long the new cmd must run to be up, in seconds
+	long up_secs = 1;
+
+	// for --listen
+	char *listen_addr = NULL;
+
+	const char *getopt_str = "+Bbdf:hL:l:M:m:n:o:p:q:R:r:S:s:t:u:VwYyz";
 
 	struct option longopts[] = {
 		{ "background",		no_argument,		NULL,	'b' },
 		{ "daemon",		no_argument,		NULL,	'b' },
 		{ "debug",		no_argument,		NULL,	'd' },
+		{ "file",		required_argument,	NULL,	'f' },
 		{ "help",		no_argument,		NULL,	'h' },
 		{ "loglevel",		required_argument,	NULL,	'L' },
 		{ "log",		required_argument,	NULL,	'l' },
@@ -81,6 +264,7 @@ main(int argc, char *argv[])
 		{ "name",		required_argument,	NULL,	'n' },
 		{ "output-mask",	required_argument,	NULL,	'o' },
 		{ "pids",		required_argument,	NULL,	'p' },
+		{ "query",		required_argument,	NULL,	'q' },
 		{ "recent-secs-log",	required_argument,	NULL,	'R' },
 		{ "recent-secs",	required_argument,	NULL,	'r' },
 		{ "status-exit",	required_argument,	NULL,	'S' },
@@ -88,14 +272,62 @@ main(int argc, char *argv[])
 		{ "timeout",		required_argument,	NULL,	't' },
 		{ "uid",		required_argument,	NULL,	'u' },
 		{ "version",		no_argument,		NULL,	'V' },
+		{ "store",		no_argument,		NULL,	'w' },
 		{ "syslog-only",	no_argument,		NULL,	'Y' },
 		{ "syslog",		no_argument,		NULL,	'y' },
+		{ "compress",		no_argument,		NULL,	'z' },
+		{ "admit-burst",	required_argument,	NULL,	OPT_ADMIT_BURST },
+		{ "admit-rate",		required_argument,	NULL,	OPT_ADMIT_RATE },
+		{ "cgroup",		no_argument,		NULL,	OPT_CGROUP },
+		{ "collapse",		no_argument,		NULL,	OPT_COLLAPSE },
+		{ "compile",		required_argument,	NULL,	OPT_COMPILE },
+		{ "deadline",		required_argument,	NULL,	OPT_DEADLINE },
+		{ "env",		required_argument,	NULL,	OPT_ENV },
+		{ "follow",		no_argument,		NULL,	OPT_FOLLOW },
+		{ "forward",		required_argument,	NULL,	OPT_FORWARD },
+		{ "forward-buffer",	required_argument,	NULL,	OPT_FORWARD_BUFFER },
+		{ "freeze",		required_argument,	NULL,	OPT_FREEZE },
+		{ "idle",		required_argument,	NULL,	OPT_IDLE },
+		{ "ksm",		no_argument,		NULL,	OPT_KSM },
+		{ "last",		required_argument,	NULL,	OPT_LAST },
+		{ "listen",		required_argument,	NULL,	OPT_LISTEN },
+		{ "log-async",		required_argument,	NULL,	OPT_LOG_ASYNC },
+		{ "log-buffer",		required_argument,	NULL,	OPT_LOG_BUFFER },
+		{ "memlock",		required_argument,	NULL,	OPT_MEMLOCK },
+		{ "numa",		required_argument,	NULL,	OPT_NUMA },
+		{ "on-change",		required_argument,	NULL,	OPT_ON_CHANGE },
+		{ "on-exit",		required_argument,	NULL,	OPT_ON_EXIT },
+		{ "pidfile",		required_argument,	NULL,	OPT_PIDFILE },
+		{ "psi-cpu",		required_argument,	NULL,	OPT_PSI_CPU },
+		{ "psi-io",		required_argument,	NULL,	OPT_PSI_IO },
+		{ "psi-memory",		required_argument,	NULL,	OPT_PSI_MEMORY },
+		{ "rate-bytes",		required_argument,	NULL,	OPT_RATE_BYTES },
+		{ "rate-lines",		required_argument,	NULL,	OPT_RATE_LINES },
+		{ "ready-fd",		required_argument,	NULL,	OPT_READY_FD },
+		{ "replace",		required_argument,	NULL,	OPT_REPLACE },
+		{ "sample",		required_argument,	NULL,	OPT_SAMPLE },
+		{ "sample-tree",	no_argument,		NULL,	OPT_SAMPLE_TREE },
+		{ "shutdown",		no_argument,		NULL,	OPT_SHUTDOWN },
+		{ "since",		required_argument,	NULL,	OPT_SINCE },
+		{ "standby",		no_argument,		NULL,	OPT_STANDBY },
+		{ "store-keep",		required_argument,	NULL,	OPT_STORE_KEEP },
+		{ "store-size",		required_argument,	NULL,	OPT_STORE_SIZE },
+		{ "subreaper",		no_argument,		NULL,	OPT_SUBREAPER },
+		{ "tail",		required_argument,	NULL,	OPT_TAIL },
+		{ "tail-size",		required_argument,	NULL,	OPT_TAIL_SIZE },
+		{ "thaw",		required_argument,	NULL,	OPT_THAW },
+		{ "thp-disable",	no_argument,		NULL,	OPT_THP_DISABLE },
+		{ "until",		required_argument,	NULL,	OPT_UNTIL },
+		{ "up-secs",		required_argument,	NULL,	OPT_UP_SECS },
 		{ NULL,			0,			NULL,	0 }
 	};
 
+	// number of words of cmd from a service file (-f), -1 without one
+	int file_ncmd = -1;
+
 	int ch;
 	char *logstring = NULL;
-	char *largv[32];
+	char **largv = NULL;
 	while ((ch = getopt_long(argc, argv, getopt_str, longopts, NULL)) != -1) {
 		switch(ch) {
 		case 'B':
@@ -109,6 +341,42 @@ main(int argc, char *argv[])
 			slog_upto(LOG_DEBUG);
 			slog(LOG_DEBUG, "debugging on");
 			break;
+		case 'f': {
+			// Splice the service file in: its options in place of
+			// -f, so that later ones override them, and its cmd at
+			// the end.
+			char **words, **nargv;
+			int nwords, nopts, n = 0;
+
+			if (file_ncmd != -1) {
+				slog(LOG_ERR, "-f specified more than once");
+				usage();
+			}
+			nwords = svc_load(optarg, longopts, &words, &file_ncmd, 0);
+			if (nwords == -1)
+				exit(1);
+			// the cmd words are preceded by "--"
+			nopts = nwords - (file_ncmd ? file_ncmd + 1 : 0);
+
+			nargv = malloc((nwords + argc + 1) * sizeof(*nargv));
+			if (nargv == NULL) {
+				slog(LOG_ERR, "malloc() failed: %m");
+				exit(1);
+			}
+			for (int i=0; i<optind; i++)
+				nargv[n++] = argv[i];
+			for (int i=0; i<nopts; i++)
+				nargv[n++] = words[i];
+			for (int i=optind; i<argc; i++)
+				nargv[n++] = argv[i];
+			for (int i=nopts; i<nwords; i++)
+				nargv[n++] = words[i];
+			nargv[n] = NULL;
+
+			argc = n;
+			argv = nargv;
+			break;
+		}
 		case 'h':
 			usage();
 			exit(0);
@@ -139,69 +407,22 @@ main(int argc, char *argv[])
 			if (out_mask == -1)
 				out_mask = 3;
 
-			// parse into an argv; gnarly
+			// parse into an argv
 			if (logstring != NULL) {
 				slog(LOG_ERR, "-l specified more than once");
 				usage();
 			}
-			for (int i=0; i<32; i++)
-				largv[i] = NULL;
 
 			logstring = malloc(strlen(optarg) + 1);
 			strcpy(logstring, optarg);
 
-			int i = 0;
-			char *c = logstring;
-
-			largv[0] = c;
-
-			while (1) {
-				// consume any leading spaces
-				while (*c == ' ') {
-					*c = '\0';
-					c++;
-				}
-
-				// end of string
-				if (*c == '\0')
-					break;
-
-				if (i == 32) {
-					slog(LOG_ERR, "too many words in -l arg");
-					exit(1);
-				}
-
-				if (*c != '"') {
-					// normal argument
-					largv[i] = c;
-					while (*c != ' ' && *c != '\0')
-						c++;
-				} else {
-					// double-quoted argument
-					*c = '\0';
-					c++;
-					largv[i] = c;
-
-					while (*c != '"' && *c != '\0')
-						c++;
-
-					if (*c == '\0') {
-						slog(LOG_ERR, "unmatched double-quote in -l arg");
-						usage();
-					} else {
-						*c = '\0';
-						c++;
-					}
-				}
-
-				i++;
+			if (split_words(logstring, &largv) == -1) {
+				slog(LOG_ERR, "unmatched double-quote in -l arg");
+				usage();
 			}
 
-			for (int i=0; i<32; i++) {
-				if (largv[i] == NULL)
-					break;
+			for (int i=0; largv[i] != NULL; i++)
 				slog(LOG_DEBUG, "largv: %s", largv[i]);
-			}
 			break;
 		case 'M':
 			chld[1].max_recent_execs = str_to_l(optarg);
@@ -224,6 +445,10 @@ main(int argc, char *argv[])
 			name = optarg;
 			do_status = 'p';
 			break;
+		case 'q':
+			name = optarg;
+			do_status = 'q';
+			break;
 		case 'R':
 			chld[1].recent_secs = str_to_l(optarg);
 			break;
@@ -248,12 +473,241 @@ main(int argc, char *argv[])
 			printf("fsv %s\n", FSV_VERSION);
 			exit(0);
 			break;
+		case 'w':
+			if (out_mask == -1)
+				out_mask = 3;
+			sc.store = 1;
+			break;
 		case 'Y':
 			slog_open(NULL, LOG_PID, LOG_DAEMON);
 			break;
 		case 'y':
 			slog_open(NULL, LOG_PID|LOG_PERROR, LOG_DAEMON);
 			break;
+		case 'z':
+			sc.store_compress = 1;
+			break;
+		case OPT_ADMIT_BURST:
+			admit_burst = str_to_l(optarg);
+			if (admit_burst == 0) {
+				slog(LOG_ERR, "--admit-burst must be at least 1");
+				usage();
+			}
+			break;
+		case OPT_ADMIT_RATE:
+			admit_rate = str_to_l(optarg);
+			break;
+		case OPT_CGROUP:
+			fsv.cgroup = 1;
+			break;
+		case OPT_COLLAPSE:
+			sc.collapse = 1;
+			break;
+		case OPT_COMPILE: {
+			char **words;
+			int ncmd;
+
+			if (svc_load(optarg, longopts, &words, &ncmd, 1) == -1)
+				exit(1);
+			exit(0);
+			break;
+		}
+		case OPT_DEADLINE:
+			deadline = str_to_l(optarg);
+			break;
+		case OPT_ENV: {
+			// only for cmd; optarg may be in the read-only
+			// service file cache, which is fine for that
+			char *eq = strchr(optarg, '=');
+			char **p;
+
+			if (eq == NULL || eq == optarg) {
+				slog(LOG_ERR, "--env must be NAME=VALUE");
+				usage();
+			}
+			p = realloc(env_add, (nenv + 1) * sizeof(*env_add));
+			if (p == NULL) {
+				slog(LOG_ERR, "realloc() failed: %m");
+				exit(1);
+			}
+			env_add = p;
+			env_add[nenv++] = optarg;
+			break;
+		}
+		case OPT_FOLLOW:
+			do_follow = 1;
+			break;
+		case OPT_FORWARD:
+			if (*optarg != '/') {
+				slog(LOG_ERR, "--forward must be an absolute path");
+				usage();
+			}
+			if (out_mask == -1)
+				out_mask = 3;
+			sc.fwd_path = optarg;
+			break;
+		case OPT_FORWARD_BUFFER:
+			sc.fwd_kib = str_to_l(optarg);
+			// room for the longest record
+			if (sc.fwd_kib < 8) {
+				slog(LOG_ERR, "--forward-buffer must be at least 8");
+				usage();
+			}
+			break;
+		case OPT_FREEZE:
+			name = optarg;
+			do_status = OPT_FREEZE;
+			break;
+		case OPT_IDLE:
+			fsv.od_idle = str_to_l(optarg);
+			break;
+		case OPT_KSM:
+			chld[0].mem.ksm = 1;
+			break;
+		case OPT_LAST:
+			q_last = str_to_l(optarg);
+			break;
+		case OPT_LISTEN:
+			listen_addr = optarg;
+			break;
+		case OPT_LOG_ASYNC:
+			fsv.slog_slots = str_to_l(optarg);
+			if (fsv.slog_slots == 0 || fsv.slog_slots > 65536) {
+				slog(LOG_ERR, "--log-async must be 1 to 65536");
+				usage();
+			}
+			break;
+		case OPT_LOG_BUFFER:
+			sc.log_buffer_kib = str_to_l(optarg);
+			if (sc.log_buffer_kib == 0) {
+				slog(LOG_ERR, "--log-buffer must be at least 1");
+				usage();
+			}
+			break;
+		case OPT_MEMLOCK:
+			chld[0].mem.memlock = 1;
+			if (strcmp(optarg, "unlimited") == 0)
+				chld[0].mem.memlock_kib = -1;
+			else
+				chld[0].mem.memlock_kib = str_to_l(optarg);
+			break;
+		case OPT_NUMA:
+			if (strlen(optarg) >= sizeof(chld[0].mem.numa)) {
+				slog(LOG_ERR, "--numa arg too long");
+				usage();
+			}
+			strcpy(chld[0].mem.numa, optarg);
+			break;
+		case OPT_ON_CHANGE:
+			if (strcmp(optarg, "keep") == 0)
+				fsv.exe_keep = 1;
+			else if (strcmp(optarg, "reload") == 0)
+				fsv.exe_keep = 0;
+			else {
+				slog(LOG_ERR, "--on-change must be keep or reload");
+				usage();
+			}
+			break;
+		case OPT_ON_EXIT:
+			if (pol_parse(optarg) == -1)
+				usage();
+			break;
+		case OPT_PIDFILE:
+			if (*optarg != '/') {
+				slog(LOG_ERR, "--pidfile must be an absolute path");
+				usage();
+			}
+			pidfile = optarg;
+			do_subreaper = 1;
+			break;
+		case OPT_PSI_CPU:
+			psi_limit[0] = str_to_l(optarg);
+			break;
+		case OPT_PSI_IO:
+			psi_limit[2] = str_to_l(optarg);
+			break;
+		case OPT_PSI_MEMORY:
+			psi_limit[1] = str_to_l(optarg);
+			break;
+		case OPT_RATE_BYTES:
+			sc.rate_bytes = str_to_l(optarg);
+			break;
+		case OPT_RATE_LINES:
+			sc.rate_lines = str_to_l(optarg);
+			break;
+		case OPT_READY_FD:
+			ready_fd = chld[0].ready_fd = str_to_l(optarg);
+			if (ready_fd < 3) {
+				slog(LOG_ERR, "--ready-fd must be at least 3");
+				usage();
+			}
+			break;
+		case OPT_REPLACE:
+			name = optarg;
+			do_status = OPT_REPLACE;
+			break;
+		case OPT_SAMPLE:
+			chld[0].usage.interval = str_to_l(optarg);
+			break;
+		case OPT_SAMPLE_TREE:
+			chld[0].usage.tree = 1;
+			break;
+		case OPT_SHUTDOWN:
+			do_status = OPT_SHUTDOWN;
+			break;
+		case OPT_SINCE:
+			q_since = store_parse_time(optarg);
+			if (q_since == -1) {
+				slog(LOG_ERR, "unrecognized time for --since");
+				usage();
+			}
+			break;
+		case OPT_STANDBY:
+			do_standby = 1;
+			break;
+		case OPT_STORE_KEEP:
+			sc.store_keep = str_to_l(optarg);
+			if (sc.store_keep == 0) {
+				slog(LOG_ERR, "--store-keep must be at least 1");
+				usage();
+			}
+			break;
+		case OPT_STORE_SIZE:
+			sc.store_kib = str_to_l(optarg);
+			break;
+		case OPT_SUBREAPER:
+			do_subreaper = 1;
+			break;
+		case OPT_TAIL:
+			name = optarg;
+			do_status = OPT_TAIL;
+			break;
+		case OPT_TAIL_SIZE:
+			if (out_mask == -1)
+				out_mask = 3;
+			sc.tail_kib = str_to_l(optarg);
+			if (sc.tail_kib == 0) {
+				slog(LOG_ERR, "--tail-size must be at least 1");
+				usage();
+			}
+			break;
+		case OPT_THAW:
+			name = optarg;
+			do_status = OPT_THAW;
+			break;
+		case OPT_THP_DISABLE:
+			chld[0].mem.thp_disable = 1;
+			break;
+		case OPT_UNTIL:
+			q_until = store_parse_time(optarg);
+			if (q_until == -1) {
+				slog(LOG_ERR, "unrecognized time for --until");
+				usage();
+			}
+			break;
+		case OPT_UP_SECS:
+			up_secs = str_to_l(optarg);
+			break;
 		case '?':
 		default:
 			usage();
@@ -263,6 +717,16 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (listen_addr != NULL && ready_fd == 3) {
+		slog(LOG_ERR, "--listen passes fd 3; use another --ready-fd");
+		usage();
+	}
+
+	if (file_ncmd > 0 && argc != file_ncmd) {
+		slog(LOG_ERR, "cmd given both in the service file and here");
+		usage();
+	}
+
 	slog(LOG_DEBUG, "finished processing options");
 
 	/*
@@ -282,6 +746,26 @@ main(int argc, char *argv[])
 	sigaddset(&bmask, SIGINT);
 	sigaddset(&bmask, SIGHUP);
 	sigaddset(&bmask, SIGTERM);
+	// writing to a standby child that went away should fail with EPIPE;
+	// this one is simply ignored by the main loop
+	sigaddset(&bmask, SIGPIPE);
+	// a child got as far as exec, or said that it is ready
+	sigaddset(&bmask, SIGIO);
+	// for --replace, when a step of it runs out of time
+	sigaddset(&bmask, SIGREPSTEP);
+	// with --subreaper and --pidfile, when to look at the pidfile again
+	sigaddset(&bmask, SIGPIDFILE);
+	// with --sample, when to take the next sample
+	sigaddset(&bmask, SIGSAMPLE);
+	// with --listen and --idle, when to look for connections again
+	sigaddset(&bmask, SIGIDLE);
+	// start replacing cmd
+	sigaddset(&bmask, SIGREPLACE);
+	// with a cgroup, these freeze and thaw cmd instead of stopping fsv
+	if (fsv.cgroup) {
+		sigaddset(&bmask, SIGTSTP);
+		sigaddset(&bmask, SIGCONT);
+	}
 
 	/*
 	 * Declare/init fsvdir, to chdir() later.
@@ -311,6 +795,19 @@ main(int argc, char *argv[])
 		if (status_uid == -1)
 			status_uid = geteuid();
 
+		if (do_status == 'q') {
+			if (q_until == -1)
+				q_until = time(NULL) + 1;
+			store_query(status_uid, name, q_since, q_until, q_last);
+		}
+		if (do_status == OPT_TAIL)
+			tail_follow(status_uid, name, do_follow);
+		if (do_status == OPT_FREEZE || do_status == OPT_THAW)
+			cg_control(status_uid, name, do_status == OPT_FREEZE);
+		if (do_status == OPT_SHUTDOWN)
+			stop_all(status_uid, argv, argc, deadline);
+		if (do_status == OPT_REPLACE)
+			replace_cmd(status_uid, name);
 		status(do_status, status_uid, name);
 	}
 
@@ -335,10 +832,19 @@ main(int argc, char *argv[])
 		strcpy(name, basename(tmp));
 	}
 
+	// a leading dot is for what the fsvdir holds besides services,
+	// like .admit and .svc
 	if (*name == '.' || *name == '/') {
 		slog(LOG_ERR, "name does not make sense");
 		usage();
 	}
+	svc_name = name;
+	sc.fwd_name = name;
+
+	// before changing directory, so that relative paths work
+	exe_open(0, &chld[0].exe, argv[0], fsv.exe_keep);
+	if (logstring != NULL && largv[0] != NULL)
+		exe_open(1, &chld[1].exe, largv[0], fsv.exe_keep);
 
 	/*
 	 * chdir() to the directory.
@@ -385,6 +891,21 @@ main(int argc, char *argv[])
 		}
 	}
 
+	// the admission schedule is shared by the whole fsvdir
+	int fd_admit = -1;
+	if (admit_rate > 0) {
+		if (admit_burst == 0)
+			admit_burst = admit_rate;
+		fd_admit = admit_open();
+		if (fd_admit == -1)
+			exit(1);
+		fsv.admit_rate = admit_rate;
+	}
+
+	int do_psi = psi_limit[0] || psi_limit[1] || psi_limit[2];
+	if (do_psi)
+		psi_init();
+
 	// cd to $name
 	if (mkdir(name, 00755) == -1) {
 		if (errno == EEXIST) {
@@ -399,6 +920,29 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (fsv.cgroup && cg_open(name) == -1)
+		exit(1);
+	if (mem_init(&chld[0].mem) == -1)
+		exit(1);
+	if (chld[0].usage.interval > 0)
+		smp_init(&chld[0].usage, fsv.cgroup);
+
+	if (listen_addr != NULL) {
+		listen_fd = od_listen(listen_addr);
+		if (listen_fd == -1)
+			exit(1);
+		fsv.od_state = OD_IDLE;
+	}
+
+	// after od_listen(), which adds to the environment itself
+	if (nenv > 0) {
+		cmd_env = env_build(env_add, nenv);
+		if (cmd_env == NULL) {
+			slog(LOG_ERR, "malloc() failed: %m");
+			exit(1);
+		}
+	}
+
 	/*
 	 * Create logging pipe.
 	 * Open some other file descriptors.
@@ -410,6 +954,29 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	// If fsv needs to see the output itself, cmd writes into cmdpipe
+	// and the sink thread relays it to logpipe.
+	// That is always the case with a log process, so that cmd never
+	// blocks on its output while log is down.
+	// The pipes are only ever passed on through dup2(2),
+	// so they can be close-on-exec.
+	int do_sink = sc.store || sc.tail_kib || sc.collapse ||
+	    sc.rate_lines != 0 || sc.rate_bytes != 0 || logstring != NULL ||
+	    sc.fwd_path != NULL;
+	int cmdpipe[2] = { -1, -1 };
+	// the pipe that cmd's output goes into
+	int *cmd_pipe = do_sink ? cmdpipe : logpipe;
+	if (do_sink) {
+		if (pipe(cmdpipe) == -1) {
+			slog(LOG_ERR, "pipe() failed: %m");
+			exit(1);
+		}
+		fcntl(cmdpipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(cmdpipe[1], F_SETFD, FD_CLOEXEC);
+		fcntl(logpipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(logpipe[1], F_SETFD, FD_CLOEXEC);
+	}
+
 	// open and flock(2) the lockfile
 	int fd_lock;
 	fd_lock = open("lock", O_CREAT|O_RDWR, 00600);
@@ -454,6 +1021,14 @@ main(int argc, char *argv[])
 	// set my pid now, because the fork changes it
 	fsv.pid = getpid();
 
+	// this isn't inherited, so must come after daemon()
+	if (do_subreaper && reaper_init() == -1)
+		exit(1);
+	// nor is the owner for SIGIO
+	exe_watch(chld);
+	if (listen_fd != -1)
+		od_arm(listen_fd);
+
 	fcntl(fd_info, F_SETFD, FD_CLOEXEC);
 
 	/*
@@ -462,6 +1037,30 @@ main(int argc, char *argv[])
 
 	sigprocmask(SIG_BLOCK, &bmask, NULL);
 
+	// from here on, a slow syslogd or a stopped terminal must not
+	// hold up the main loop; slog() only queues the message
+	if (fsv.slog_slots > 0 && slog_async(fsv.slog_slots) == -1) {
+		slog(LOG_WARNING, "slog_async() failed, logging directly: %m");
+		fsv.slog_slots = 0;
+	}
+
+	/*
+	 * Start the sink thread, if needed.
+	 * This must come after daemon() and blocking signals,
+	 * since the thread would not survive the former and
+	 * inherits the signal mask.
+	 */
+
+	if (do_sink) {
+		if (logstring == NULL) {
+			if (sink_start(&sc, cmdpipe[0], -1, -1) == -1)
+				exit(1);
+		} else {
+			if (sink_start(&sc, cmdpipe[0], logpipe[1], logpipe[0]) == -1)
+				exit(1);
+		}
+	}
+
 	/*
 	 * Initialize the timers.
 	 * cmd_tmout_itspec is the main one. It is used for the cmd "timeout".
@@ -498,11 +1097,67 @@ main(int argc, char *argv[])
 		}
 	}
 
+	// SIGREPSTEP, for --replace
+	{
+		struct sigevent sev;
+		sev.sigev_notify = SIGEV_SIGNAL;
+		sev.sigev_signo = SIGREPSTEP;
+
+		if (timer_create(CLOCK_MONOTONIC, &sev, &rep_tid) == -1) {
+			slog(LOG_ERR, "timer_create() failed: %m");
+			exit(1);
+		}
+	}
+
+	// SIGPIDFILE, to look at the pidfile while cmd goes into the background
+	if (do_subreaper && pidfile != NULL) {
+		struct sigevent sev;
+		sev.sigev_notify = SIGEV_SIGNAL;
+		sev.sigev_signo = SIGPIDFILE;
+
+		if (timer_create(CLOCK_MONOTONIC, &sev, &fol_tid) == -1) {
+			slog(LOG_ERR, "timer_create() failed: %m");
+			exit(1);
+		}
+	}
+
+	// SIGIDLE, for --idle
+	if (listen_fd != -1 && fsv.od_idle > 0) {
+		struct sigevent sev;
+		sev.sigev_notify = SIGEV_SIGNAL;
+		sev.sigev_signo = SIGIDLE;
+
+		if (timer_create(CLOCK_MONOTONIC, &sev, &idle_tid) == -1) {
+			slog(LOG_ERR, "timer_create() failed: %m");
+			exit(1);
+		}
+	}
+
+	// SIGSAMPLE, for --sample
+	if (chld[0].usage.interval > 0) {
+		timer_t smp_tid;
+		struct itimerspec its = { {chld[0].usage.interval, 0},
+		    {chld[0].usage.interval, 0}};
+		struct sigevent sev;
+		sev.sigev_notify = SIGEV_SIGNAL;
+		sev.sigev_signo = SIGSAMPLE;
+
+		if (timer_create(CLOCK_MONOTONIC, &sev, &smp_tid) == -1 ||
+		    timer_settime(smp_tid, 0, &its, NULL) == -1) {
+			slog(LOG_ERR, "timer for --sample failed: %m");
+			exit(1);
+		}
+	}
+
 	/*
 	 * Start cmd and log for the first time.
+	 * On demand, cmd waits for a connection.
 	 */
 
-	raise(SIGUSR1);
+	if (listen_fd == -1)
+		raise(SIGUSR1);
+	else if (!od_activate(&fsv, &chld[0]))
+		write_info(fd_info, &fsv, chld);
 	raise(SIGUSR2);
 
 	/*
@@ -511,35 +1166,207 @@ main(int argc, char *argv[])
 
 	slog(LOG_DEBUG, "begin main loop");
 
+	// the standby cmd child, if any, and the pipe to start it
+	pid_t sb_pid = 0;
+	int sb_ctl = -1;
+	int sb_watch[2] = { -1, -1 };
+
+	// when cmd and log were last reaped, to time restarts
+	struct timespec reaped[2] = { { 0, 0 }, { 0, 0 } };
+
+	// seconds until pressure is checked again, while restarts are deferred
+	long psi_delay = 0;
+
+	// true if cmd is to be started once thawed
+	int thaw_start = 0;
+
+	// true if the next start of cmd isn't counted in recent_execs
+	int restart_now = 0;
+
 	int sig;
-	while (sigwait(&bmask, &sig) == 0) switch (sig) {
+	while (sigwait(&bmask, &sig) == 0) switch (sig_case(sig)) {
 	case SIGCHLD:
 		slog(LOG_DEBUG, "> SIGCHLD");
 
 		int status;
 		pid_t epid;
-
-		// wait() on all terminated children
-		while ((epid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct timespec sigts;
+		clock_gettime(CLOCK_MONOTONIC, &sigts);
+
+		// wait() on all terminated children; first, cmd when it
+		// turned out not to have gone into the background after all
+		while ((epid = fol_over ? fol_pid :
+		    waitpid(-1, &status, WNOHANG)) > 0) {
+			int followed = 0;
+
+			if (fol_over) {
+				status = fol_status;
+				chld[0].pid = epid;
+				fol_pid = 0;
+				fol_over = 0;
+				followed = 1;
+			}
+			if (epid == sb_pid) {
+				slog(LOG_DEBUG, "standby child went away");
+				standby_drop(&sb_pid, &sb_ctl, sb_watch);
+				continue;
+			}
+			if (epid == rep_left) {
+				slog(LOG_NOTICE, "old cmd process %ld is gone",
+				    (long)epid);
+				rep_left = 0;
+				rep_arm(0);
+				continue;
+			}
+			if (epid == fsv.rep_old) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				slog(LOG_NOTICE, "old cmd process %ld is gone",
+				    (long)epid);
+				fsv.rep_old = 0;
+				if (fsv.rep_state == REP_ABORTING) {
+					// neither is left; the new one is
+					// reaped as cmd and restarted as usual
+					fsv.rep_aborts++;
+				} else {
+					// it went on its own before the new
+					// one was up, which is as good
+					fsv.replaces++;
+					hist_add(&fsv.rep_overlap, &fsv.rep_since,
+					    &now);
+				}
+				fsv.rep_state = REP_NONE;
+				rep_arm(0);
+				write_info(fd_info, &fsv, chld);
+				continue;
+			}
 			if (epid != chld[0].pid && epid != chld[1].pid) {
-				slog(LOG_DEBUG, "??? unknown child!");
+				if (do_subreaper)
+					slog(LOG_DEBUG, "reaped orphan %ld",
+					    (long)epid);
+				else
+					slog(LOG_DEBUG, "??? unknown child!");
+			}
+
+			// A daemon forking into the background looks like
+			// cmd exiting; follow the real main process instead.
+			if (epid == chld[0].pid && do_subreaper && !followed) {
+				pid_t skip[2] = { chld[1].pid, sb_pid };
+				pid_t mpid = reaper_follow(pidfile, status,
+				    skip, 2);
+				if (mpid == -1) {
+					// look again from the main loop
+					struct itimerspec its = {
+					    {0, REAPER_POLL_MS * 1000000},
+					    {0, REAPER_POLL_MS * 1000000}};
+					slog(LOG_DEBUG, "waiting for the pidfile");
+					fol_pid = epid;
+					fol_status = status;
+					chld[0].pid = 0;
+					timer_settime(fol_tid, 0, &its, NULL);
+					continue;
+				}
+				if (mpid > 0) {
+					slog(LOG_INFO, "cmd process %ld went into "
+					    "the background as %ld, following it",
+					    (long)epid, (long)mpid);
+					if (chld[0].started_as == 0)
+						chld[0].started_as = epid;
+					chld[0].pid = mpid;
+					write_info(fd_info, &fsv, chld);
+					continue;
+				}
 			}
 
 			for (int i=0; i<2; i++) if (epid == chld[i].pid) {
 				// cmd or log has exited
+				FSV_PROBE5(reap, svc_name, i, epid, status,
+				    probe_ns(&chld[i].since));
 				chld[i].pid = 0;
+				chld[i].started_as = 0;
+				clock_gettime(CLOCK_MONOTONIC, &reaped[i]);
+				hist_add(&chld[i].exit_reap, &sigts, &reaped[i]);
+
+				// SIGIO comes after SIGCHLD, so look now
+				watch_check(&chld[i], i);
+				watch_close(i);
+				chld[i].ready = 0;
 
 				char buf[32];
-				if (WIFEXITED(status)) {
+				if (exec_err[i]) {
+					snprintf(buf, sizeof(buf),
+					    "could not be executed");
+				} else if (WIFEXITED(status)) {
 					snprintf(buf, sizeof(buf),
 					    "exited %d", WEXITSTATUS(status));
 				} else if (WIFSIGNALED(status)) {
 					snprintf(buf, sizeof(buf),
 					    "terminated by signal %d", WTERMSIG(status));
 				}
-
-				if (i == 0) {
+				int action = pol_classify(&chld[i], status,
+				    exec_err[i]);
+				exec_err[i] = 0;
+
+				if (i == 0 && fsv.rep_state == REP_STOPPING) {
+					// The new one of a replace, once the old
+					// was told to stop: too late to keep that,
+					// so it is a failed replace and cmd is
+					// handled below as usual. The old one
+					// still gets until the deadline.
+					slog(LOG_WARNING, "new cmd process %s "
+					    "while the old one was stopping", buf);
+					rep_left = fsv.rep_old;
+					fsv.rep_old = 0;
+					fsv.rep_state = REP_NONE;
+					fsv.rep_aborts++;
+					write_info(fd_info, &fsv, chld);
+				}
+				if (i == 0 && fsv.rep_old > 0) {
+					// the new one of a replace; keep the old
+					slog(LOG_WARNING, "new cmd process %s, "
+					    "keeping the old one", buf);
+					chld[0].pid = fsv.rep_old;
+					chld[0].since = rep_prev.since;
+					chld[0].ready = rep_prev.ready;
+					fsv.rep_old = 0;
+					fsv.rep_state = REP_NONE;
+					fsv.rep_aborts++;
+					rep_arm(0);
+					write_info(fd_info, &fsv, chld);
+				} else if (i == 0 && fsv.od_state == OD_IDLE) {
+					// stopped for being idle
+					slog(LOG_NOTICE, "cmd process %s", buf);
+					od_arm(listen_fd);
+					od_activate(&fsv, &chld[0]);
+					write_info(fd_info, &fsv, chld);
+				} else if (i == 0 && action == POL_DONE) {
+					slog(LOG_NOTICE, "cmd process %s, which "
+					    "means it is done; exiting", buf);
+					sink_stop(termprocs(&fsv, chld));
+					fsv.pid = 0;
+					write_info(fd_info, &fsv, chld);
+					exit(0);
+				} else if (i == 0 && action == POL_GIVEUP &&
+				    fsv.timeout == 0) {
+					slog(LOG_WARNING, "cmd process %s, "
+					    "not restarting it; exiting", buf);
+					FSV_PROBE2(giveup, svc_name, i);
+					sink_stop(termprocs(&fsv, chld));
+					fsv.pid = 0;
+					fsv.gaveup = 1;
+					write_info(fd_info, &fsv, chld);
+					exit(0);
+				} else if (i == 0 && action == POL_GIVEUP) {
+					slog(LOG_WARNING, "cmd process %s, "
+					    "not restarting it for %ld secs",
+					    buf, fsv.timeout);
+					timer_settime(cmd_tid, 0, &cmd_tmout_itspec,
+					    NULL);
+					write_info(fd_info, &fsv, chld);
+				} else if (i == 0) {
 					slog(LOG_NOTICE, "cmd process %s", buf);
+					if (action == POL_NOW)
+						restart_now = 1;
 					raise(SIGUSR1);
 				} else if (i == 1) {
 					slog(LOG_NOTICE, "log process %s", buf);
@@ -559,12 +1386,12 @@ main(int argc, char *argv[])
 			slog(LOG_DEBUG, "> SIGUSR1");
 			n = 0;
 			cname = "cmd";
-		} else if (sig == SIGUSR2) {
+		} else {
 			slog(LOG_DEBUG, "> SIGUSR2");
 			n = 1;
 			cname = "log";
-			if (out_mask == -1) {
-				slog(LOG_DEBUG, "but out_mask is -1, ignore");
+			if (logstring == NULL) {
+				slog(LOG_DEBUG, "but there is no log process, ignore");
 				break;
 			}
 		}
@@ -573,12 +1400,99 @@ main(int argc, char *argv[])
 			slog(LOG_DEBUG, "but the process is already running");
 			break;
 		}
+		if (n == 0 && fol_pid != 0) {
+			slog(LOG_DEBUG, "but it may have gone into the background");
+			break;
+		}
+
+		if (n == 0 && fsv.od_state == OD_IDLE) {
+			slog(LOG_DEBUG, "but cmd is waiting for a connection");
+			break;
+		}
+
+		// a frozen service hasn't crashed; it just has to wait
+		if (n == 0 && chld[n].frozen) {
+			slog(LOG_INFO, "cmd is frozen, will start it once thawed");
+			thaw_start = 1;
+			write_info(fd_info, &fsv, chld);
+			break;
+		}
+
+		// Hold off restarts of cmd while under pressure, checking
+		// again after a delay that doubles up to PSI_DELAY_MAX.
+		// This comes before admission control so that a deferred
+		// restart doesn't hold a slot, and before recent_execs so
+		// that it doesn't use up max_recent_execs.
+		if (n == 0 && do_psi && !chld[n].queued &&
+		    chld[n].total_execs > 0) {
+			char why[sizeof(chld[n].defer_reason)];
+			if (psi_check(psi_limit, why, sizeof(why))) {
+				if (!chld[n].deferred) {
+					slog(LOG_WARNING,
+					    "restart of cmd deferred: %s", why);
+					chld[n].deferred = 1;
+					chld[n].deferrals++;
+					psi_delay = 1;
+				} else {
+					slog(LOG_DEBUG,
+					    "restart of cmd still deferred: %s", why);
+					psi_delay *= 2;
+					if (psi_delay > PSI_DELAY_MAX)
+						psi_delay = PSI_DELAY_MAX;
+				}
+				strcpy(chld[n].defer_reason, why);
+
+				struct itimerspec its = { {0,0}, {psi_delay,0}};
+				timer_settime(cmd_tid, 0, &its, NULL);
+				write_info(fd_info, &fsv, chld);
+				break;
+			}
+			if (chld[n].deferred) {
+				slog(LOG_NOTICE, "pressure is down, restarting cmd");
+				chld[n].deferred = 0;
+			}
+		}
+
+		// Host-wide admission control, for cmd only.
+		// If this start was queued, its slot has come up once the
+		// timer has gone off; any other request to start cmd before
+		// then is folded into the queued start.
+		if (n == 0 && fd_admit != -1) {
+			if (chld[n].queued) {
+				struct itimerspec its;
+
+				if (timer_gettime(cmd_tid, &its) == 0 &&
+				    (its.it_value.tv_sec != 0 ||
+				    its.it_value.tv_nsec != 0)) {
+					slog(LOG_DEBUG, "but its start is queued");
+					break;
+				}
+				chld[n].queued = 0;
+			} else {
+				long long wait = admit_reserve(fd_admit,
+				    admit_rate, admit_burst);
+				if (wait > 0) {
+					struct itimerspec its = { {0,0},
+					    {wait / 1000000000, wait % 1000000000}};
+					slog(LOG_INFO,
+					    "start of cmd queued for %lld ms",
+					    wait / 1000000);
+					chld[n].queued = 1;
+					timer_settime(cmd_tid, 0, &its, NULL);
+					write_info(fd_info, &fsv, chld);
+					break;
+				}
+			}
+		}
 
 		struct timespec now;
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
-		// set recent_execs
-		if (chld[n].recent_secs == 0 ||
+		// set recent_execs; --on-exit may say that this start
+		// doesn't count
+		if (n == 0 && restart_now) {
+			restart_now = 0;
+		} else if (chld[n].recent_secs == 0 ||
 		    ((now.tv_sec - chld[n].since.tv_sec) <= chld[n].recent_secs)) {
 			chld[n].recent_execs++;
 		} else {
@@ -587,11 +1501,17 @@ main(int argc, char *argv[])
 
 		// check if limit has been exceeded
 		if (chld[n].recent_execs > chld[n].max_recent_execs) {
+			FSV_PROBE5(restart_limit, svc_name, n,
+			    chld[n].recent_execs, chld[n].max_recent_execs,
+			    !(fsv.timeout == 0 || n == 1));
+
 			// exit or timeout
 			if (fsv.timeout == 0 || n == 1) {
 				slog(LOG_WARNING, "max_recent_execs exceeded for %s, exiting",
 				     cname);
-				termprocs(chld);
+				FSV_PROBE2(giveup, svc_name, n);
+				sink_stop(termprocs(&fsv, chld));
+				cg_close();
 				fsv.pid = 0;
 				fsv.gaveup = 1;
 				write_info(fd_info, &fsv, chld);
@@ -600,16 +1520,32 @@ main(int argc, char *argv[])
 				slog(LOG_WARNING,
 				    "max_recent_execs exceeded for %s, timeout for %ld secs",
 				    cname, fsv.timeout);
+				FSV_PROBE3(timeout_arm, svc_name, n,
+				    fsv.timeout * 1000000000LL);
 				timer_settime(cmd_tid, 0, &cmd_tmout_itspec, NULL);
 				write_info(fd_info, &fsv, chld);
 				break;
 			}
 		}
 
+		// a new binary makes the standby child stale
+		if (exe_refresh(n, &chld[n].exe, n == 0 ? argv[0] : largv[0]) &&
+		    n == 0 && sb_pid > 0) {
+			slog(LOG_DEBUG, "dropping the standby child");
+			standby_drop(&sb_pid, &sb_ctl, sb_watch);
+		}
+
 		// exec
 		int r;
 		if (n == 0) {
-			r = fork_chld(n, &chld[n], logpipe, argv, out_mask);
+			r = -1;
+			if (sb_pid > 0) {
+				r = start_standby(&chld[n], sb_pid, sb_ctl,
+				    sb_watch);
+				sb_pid = 0;
+			}
+			if (r == -1)
+				r = fork_chld(n, &chld[n], cmd_pipe, argv, out_mask);
 			if (r == -1)
 				timer_settime(cmd_tid, 0, &cmd_itspec, NULL);
 		} else if (n == 1) {
@@ -617,14 +1553,173 @@ main(int argc, char *argv[])
 			if (r == -1)
 				timer_settime(log_tid, 0, &log_itspec, NULL);
 		}
+
+		if (r == 0 && chld[n].pid > 0 && reaped[n].tv_sec != 0) {
+			hist_add(&chld[n].reap_fork, &reaped[n], &chld[n].since);
+			reaped[n].tv_sec = 0;
+		}
+		write_info(fd_info, &fsv, chld);
+
+		// now that cmd is on its way, get the next standby ready
+		if (n == 0 && do_standby && sb_pid == 0) {
+			sb_pid = fork_standby(cmd_pipe, argv, out_mask, &sb_ctl,
+			    sb_watch);
+			if (sb_pid == -1) {
+				slog(LOG_WARNING, "fork() of standby failed: %m");
+				sb_pid = 0;
+			}
+		}
+		break;
+	}
+	case SIGTSTP:
+		slog(LOG_DEBUG, "> SIGTSTP");
+		if (chld[0].frozen || cg_freeze(1) == -1)
+			break;
+		slog(LOG_NOTICE, "cmd frozen");
+		chld[0].frozen = 1;
+		write_info(fd_info, &fsv, chld);
+		break;
+	case SIGCONT:
+		slog(LOG_DEBUG, "> SIGCONT");
+		if (!chld[0].frozen || cg_freeze(0) == -1)
+			break;
+		slog(LOG_NOTICE, "cmd thawed");
+		chld[0].frozen = 0;
 		write_info(fd_info, &fsv, chld);
+		if (thaw_start) {
+			thaw_start = 0;
+			raise(SIGUSR1);
+		}
+		break;
+	case SIGIO:
+	{
+		int changed;
+
+		slog(LOG_DEBUG, "> SIGIO");
+		changed = watch_check(&chld[0], 0) + watch_check(&chld[1], 1) +
+		    exe_check(chld);
+		// after watch_check(), which notes the exec
+		changed += od_activate(&fsv, &chld[0]);
+		changed += od_started(&fsv, &chld[0]);
+		changed += rep_check(&fsv, &chld[0], up_secs, deadline);
+		if (changed > 0)
+			write_info(fd_info, &fsv, chld);
 		break;
 	}
+	case SIG_PIDFILE:
+		slog(LOG_DEBUG, "> SIGPIDFILE");
+		if (fol_pid != 0 && !fol_over) {
+			pid_t mpid = reaper_recheck(pidfile);
+			struct itimerspec its = { {0,0}, {0,0}};
+
+			if (mpid > 0) {
+				slog(LOG_INFO, "cmd process %ld went into "
+				    "the background as %ld, following it",
+				    (long)fol_pid, (long)mpid);
+				if (chld[0].started_as == 0)
+					chld[0].started_as = fol_pid;
+				chld[0].pid = mpid;
+				fol_pid = 0;
+				timer_settime(fol_tid, 0, &its, NULL);
+				write_info(fd_info, &fsv, chld);
+			} else if (mpid == -1) {
+				// handle it as cmd exiting after all
+				fol_over = 1;
+				timer_settime(fol_tid, 0, &its, NULL);
+				raise(SIGCHLD);
+			}
+		}
+		break;
+	case SIG_REPSTEP:
+		slog(LOG_DEBUG, "> SIGREPSTEP");
+		if (rep_check(&fsv, &chld[0], up_secs, deadline))
+			write_info(fd_info, &fsv, chld);
+		break;
+	case SIG_SAMPLE:
+		slog(LOG_DEBUG, "> SIGSAMPLE");
+		if (smp_tick(&chld[0].usage, chld[0].pid))
+			write_info(fd_info, &fsv, chld);
+		break;
+	case SIG_IDLE:
+	{
+		struct timespec now;
+
+		slog(LOG_DEBUG, "> SIGIDLE");
+		if (fsv.od_idle <= 0 || fsv.od_state != OD_ACTIVE)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		// a replace takes both, so wait for it
+		if (fsv.rep_state != REP_NONE || od_busy(listen_fd)) {
+			od_busy_ts = now;
+		} else if (now.tv_sec - od_busy_ts.tv_sec >= fsv.od_idle) {
+			slog(LOG_INFO, "cmd has been idle for %ld secs, stopping it",
+			    fsv.od_idle);
+			fsv.od_state = OD_IDLE;
+			fsv.od_idle_stops++;
+			if (chld[0].pid > 0) {
+				kill(chld[0].pid, SIGTERM);
+				kill(chld[0].pid, SIGCONT);
+			}
+			write_info(fd_info, &fsv, chld);
+			break;
+		}
+		idle_arm(fsv.od_idle);
+		break;
+	}
+	case SIG_REPLACE:
+		slog(LOG_DEBUG, "> SIGREPLACE");
+		if (fsv.rep_state != REP_NONE || rep_left > 0) {
+			slog(LOG_INFO, "already replacing cmd");
+			break;
+		}
+		if (chld[0].pid <= 0 || fsv.od_state == OD_STARTING) {
+			slog(LOG_WARNING, "cmd is not running, nothing to replace");
+			break;
+		}
+		if (chld[0].frozen) {
+			slog(LOG_WARNING, "cmd is frozen, not replacing it");
+			break;
+		}
+		// the new one forking would look like the old one
+		if (do_subreaper) {
+			slog(LOG_WARNING, "can't replace cmd with --subreaper");
+			break;
+		}
+
+		if (exe_refresh(0, &chld[0].exe, argv[0]) && sb_pid > 0) {
+			slog(LOG_DEBUG, "dropping the standby child");
+			standby_drop(&sb_pid, &sb_ctl, sb_watch);
+		}
+
+		// Start the new one in place of the old one, which is only
+		// kept track of as rep_old from now on. Both write into the
+		// same pipe, so log sees a single stream.
+		rep_prev = chld[0];
+		watch_close(0);
+		chld[0].ready = 0;
+		if (fork_chld(0, &chld[0], cmd_pipe, argv, out_mask) == -1) {
+			slog(LOG_WARNING, "fork() failed: %m");
+			chld[0].pid = rep_prev.pid;
+			chld[0].since = rep_prev.since;
+			chld[0].ready = rep_prev.ready;
+			break;
+		}
+		slog(LOG_NOTICE, "replacing cmd process %ld with %ld",
+		    (long)rep_prev.pid, (long)chld[0].pid);
+		fsv.rep_old = rep_prev.pid;
+		fsv.rep_state = REP_STARTING;
+		clock_gettime(CLOCK_MONOTONIC, &fsv.rep_since);
+		rep_ts = fsv.rep_since;
+		rep_check(&fsv, &chld[0], up_secs, deadline);
+		write_info(fd_info, &fsv, chld);
+		break;
 	case SIGINT:
 	case SIGHUP:
 	case SIGTERM:
 		slog(LOG_DEBUG, "> INT, HUP, or TERM");
-		termprocs(chld);
+		sink_stop(termprocs(&fsv, chld));
+		cg_close();
 		fsv.pid = 0;
 		write_info(fd_info, &fsv, chld);
 		exit(0);
@@ -643,16 +1738,423 @@ fork_chld(int log, struct fsv_child *fc, int logpipe[], char *argv[],
           long out_mask)
 {
 	pid_t pid;
-	int fd0, fd1, fd2;
+	int fd[3];
+	int wr[2];
 
 	if (log == 1 && out_mask == -1)
 		return 0;
 
+	FSV_PROBE3(fork_entry, svc_name, log, fc->total_execs);
+
+	fc->total_execs++;
+	clock_gettime(CLOCK_MONOTONIC, &fc->since);
+
+	chld_fds(log, logpipe, out_mask, fd);
+	watch_pipes(log == 0 ? ready_fd : 0, watch[log], wr);
+
+	// now fork
+	pid = fork();
+	if (pid == 0) {
+		if (log == 0)
+			cg_enter();
+		chld_exec(log, fd, logpipe, argv, -1, wr);
+	}
+
+	FSV_PROBE4(fork_return, svc_name, log, pid, probe_ns(&fc->since));
+
+	for (int i=0; i<2; i++)
+		if (wr[i] != -1)
+			close(wr[i]);
+	if (pid == -1)
+		watch_close(log);
+
+	if (pid == -1) {
+		fc->pid = 0;
+		return -1;
+	} else {
+		fc->pid = pid;
+		return 0;
+	}
+}
+
+/*
+ * Fork a standby cmd child.
+ * It does all of the setup that fork_chld() does, then waits for
+ * start_standby() to tell it to exec, taking that off the restart path.
+ * Returns the pid, or -1 on failure; *ctl is set to the pipe to tell it.
+ * If fsv goes away, the standby sees EOF on the pipe and exits.
+ */
+pid_t
+fork_standby(int logpipe[], char *argv[], long out_mask, int *ctl,
+             int rd[])
+{
+	pid_t pid;
+	int fd[3];
+	int p[2];
+	int wr[2];
+
+	chld_fds(0, logpipe, out_mask, fd);
+
+	if (pipe(p) == -1)
+		return -1;
+	fcntl(p[0], F_SETFD, FD_CLOEXEC);
+	fcntl(p[1], F_SETFD, FD_CLOEXEC);
+
+	watch_pipes(ready_fd, rd, wr);
+
+	pid = fork();
+	if (pid == 0) {
+		close(p[1]);
+		cg_enter();
+		chld_exec(0, fd, logpipe, argv, p[0], wr);
+	}
+
+	close(p[0]);
+	for (int i=0; i<2; i++)
+		if (wr[i] != -1)
+			close(wr[i]);
+	if (pid == -1) {
+		close(p[1]);
+		for (int i=0; i<2; i++)
+			if (rd[i] != -1)
+				close(rd[i]);
+		return -1;
+	}
+
+	*ctl = p[1];
+	return pid;
+}
+
+/*
+ * On demand: start cmd if it is idle and a connection is waiting.
+ * Returns true if it did.
+ */
+static int
+od_activate(struct fsv_parent *fsv, struct fsv_child *fc)
+{
+	if (fsv->od_state != OD_IDLE || fc->pid > 0 || !od_pending(listen_fd))
+		return 0;
+
+	slog(LOG_INFO, "connection waiting, starting cmd");
+	fsv->od_state = OD_STARTING;
+	fsv->od_activations++;
+	clock_gettime(CLOCK_MONOTONIC, &od_t0);
+	// a fresh start, rather than a restart after a crash
+	fc->recent_execs = 0;
+	raise(SIGUSR1);
+	return 1;
+}
+
+/*
+ * On demand: see if cmd is up after being started for a connection,
+ * which is once it exec'd, or said it is ready with --ready-fd.
+ * Returns true if it just came up.
+ */
+static int
+od_started(struct fsv_parent *fsv, struct fsv_child *fc)
+{
+	struct timespec now;
+
+	if (fsv->od_state != OD_STARTING || fc->pid <= 0)
+		return 0;
+	// exec_ts is from this activation only if it is later
+	if (exec_ts[0].tv_sec < od_t0.tv_sec ||
+	    (exec_ts[0].tv_sec == od_t0.tv_sec &&
+	    exec_ts[0].tv_nsec < od_t0.tv_nsec))
+		return 0;
+	if (ready_fd != 0 && !fc->ready)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hist_add(&fsv->od_latency, &od_t0, &now);
+	fsv->od_state = OD_ACTIVE;
+	od_busy_ts = now;
+	if (fsv->od_idle > 0)
+		idle_arm(fsv->od_idle);
+	return 1;
+}
+
+/*
+ * What the main loop switches on for `sig'.
+ */
+static int
+sig_case(int sig)
+{
+	if (sig == SIGREPLACE)
+		return SIG_REPLACE;
+	if (sig == SIGREPSTEP)
+		return SIG_REPSTEP;
+	if (sig == SIGPIDFILE)
+		return SIG_PIDFILE;
+	if (sig == SIGSAMPLE)
+		return SIG_SAMPLE;
+	if (sig == SIGIDLE)
+		return SIG_IDLE;
+	return sig;
+}
+
+/*
+ * Have SIGIDLE come in `secs' seconds, or OD_CHECK_MAX if sooner.
+ */
+static void
+idle_arm(long secs)
+{
+	struct itimerspec its = { {0,0},
+	    {secs < OD_CHECK_MAX ? secs : OD_CHECK_MAX, 0}};
+
+	timer_settime(idle_tid, 0, &its, NULL);
+}
+
+/*
+ * Have SIGREPSTEP come in `ms' milliseconds, or never if 0.
+ */
+static void
+rep_arm(long long ms)
+{
+	struct itimerspec its = { {0,0}, {ms / 1000, ms % 1000 * 1000000}};
+
+	timer_settime(rep_tid, 0, &its, NULL);
+}
+
+/*
+ * Take a replace of cmd as far as it can go: stop the old cmd once the
+ * new one is up, which is once it has been running for `up_secs', or said
+ * that it is ready with --ready-fd; give up on the new one if it isn't up
+ * within `deadline'; and kill whichever was told to stop but hasn't
+ * within `deadline'. Both are in seconds.
+ * Returns true if it took a step.
+ */
+static int
+rep_check(struct fsv_parent *fsv, struct fsv_child *fc, long up_secs,
+          long deadline)
+{
+	struct timespec now;
+	long long ms;
+	pid_t pid;
+
+	if (fsv->rep_state == REP_NONE && rep_left == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - rep_ts.tv_sec) * 1000 +
+	    (now.tv_nsec - rep_ts.tv_nsec) / 1000000;
+
+	if (fsv->rep_state == REP_NONE) {
+		// rep_ts is still from when it was told to stop
+		if (ms < deadline * 1000) {
+			rep_arm(deadline * 1000 - ms);
+			return 0;
+		}
+		slog(LOG_WARNING, "old cmd process %ld did not stop in %ld "
+		    "secs, killing it", (long)rep_left, deadline);
+		kill(rep_left, SIGKILL);
+		return 0;
+	}
+
+	if (fsv->rep_state == REP_STARTING) {
+		// exec_ts is from the new one only if it is later
+		int execd = exec_ts[0].tv_sec > fc->since.tv_sec ||
+		    (exec_ts[0].tv_sec == fc->since.tv_sec &&
+		    exec_ts[0].tv_nsec >= fc->since.tv_nsec);
+
+		if (execd && (ready_fd != 0 ? fc->ready :
+		    ms >= up_secs * 1000)) {
+			slog(LOG_NOTICE, "new cmd process %ld is up, "
+			    "stopping the old one", (long)fc->pid);
+			kill(fsv->rep_old, SIGTERM);
+			kill(fsv->rep_old, SIGCONT);
+			fsv->rep_state = REP_STOPPING;
+			rep_ts = now;
+			rep_arm(deadline * 1000 + 1);
+			return 1;
+		}
+		if (ms >= deadline * 1000) {
+			slog(LOG_WARNING, "new cmd process %ld not up within "
+			    "%ld secs, stopping it", (long)fc->pid, deadline);
+			kill(fc->pid, SIGTERM);
+			kill(fc->pid, SIGCONT);
+			fsv->rep_state = REP_ABORTING;
+			rep_ts = now;
+			rep_arm(deadline * 1000 + 1);
+			return 1;
+		}
+		if (ready_fd == 0 && ms < up_secs * 1000)
+			rep_arm(up_secs * 1000 - ms);
+		else
+			rep_arm(deadline * 1000 - ms);
+		return 0;
+	}
+
+	if (ms < deadline * 1000) {
+		rep_arm(deadline * 1000 - ms);
+		return 0;
+	}
+	pid = fsv->rep_state == REP_STOPPING ? fsv->rep_old : fc->pid;
+	slog(LOG_WARNING, "%s cmd process %ld did not stop in %ld secs, "
+	    "killing it", fsv->rep_state == REP_STOPPING ? "old" : "new",
+	    (long)pid, deadline);
+	kill(pid, SIGKILL);
+	return 0;
+}
+
+/*
+ * Forget the standby child; closing its pipe makes it exit.
+ */
+static void
+standby_drop(pid_t *pid, int *ctl, int rd[])
+{
+	close(*ctl);
+	for (int j=0; j<2; j++)
+		if (rd[j] != -1)
+			close(rd[j]);
+	*pid = 0;
+}
+
+/*
+ * Let the standby child exec, making it the cmd process.
+ * Returns -1 if it is no longer there.
+ */
+int
+start_standby(struct fsv_child *fc, pid_t pid, int ctl, int rd[])
+{
+	ssize_t w = write(ctl, "", 1);
+	close(ctl);
+	if (w != 1) {
+		// it will be reaped as the standby, which closes rd
+		return -1;
+	}
+
 	fc->total_execs++;
 	clock_gettime(CLOCK_MONOTONIC, &fc->since);
+	fc->pid = pid;
+	watch[0][0] = rd[0];
+	watch[0][1] = rd[1];
+	rd[0] = rd[1] = -1;
+	return 0;
+}
+
+/*
+ * Make the pipes that tell fsv how far a child got.
+ * The exec one reaches EOF once the child has exec'd, or gets a byte if
+ * that failed; the ready one, made only if `rfd' isn't 0, is given to
+ * cmd as fd `rfd' and gets a newline once it is ready.
+ * The read ends go into rd[] and raise SIGIO; the write ends into wr[],
+ * for chld_exec().
+ * These only feed the latency histograms, so failure is not fatal.
+ */
+static void
+watch_pipes(int rfd, int rd[], int wr[])
+{
+	for (int i=0; i<2; i++) {
+		int p[2];
 
-	// set up fds
-	fd0 = fd1 = fd2 = fd_devnull;
+		rd[i] = wr[i] = -1;
+		if (i == 1 && rfd == 0)
+			break;
+		if (pipe(p) == -1) {
+			slog(LOG_WARNING, "pipe() failed: %m");
+			continue;
+		}
+		fcntl(p[0], F_SETFD, FD_CLOEXEC);
+		fcntl(p[1], F_SETFD, FD_CLOEXEC);
+		fcntl(p[0], F_SETOWN, getpid());
+		fcntl(p[0], F_SETFL, O_NONBLOCK|O_ASYNC);
+		rd[i] = p[0];
+		wr[i] = p[1];
+	}
+}
+
+/*
+ * See how far child n got: whether it has exec'd, and whether
+ * it is ready. Returns 1 if anything changed.
+ */
+static int
+watch_check(struct fsv_child *fc, int n)
+{
+	struct timespec now;
+	char buf[64];
+	ssize_t r;
+	int changed = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (watch[n][0] != -1) {
+		r = read(watch[n][0], buf, 1);
+		if (r == 0) {
+			hist_add(&fc->fork_exec, &fc->since, &now);
+			exec_ts[n] = now;
+		} else if (r == 1) {
+			exec_err[n] = 1;
+		}
+		if (r != -1 || errno != EAGAIN) {
+			close(watch[n][0]);
+			watch[n][0] = -1;
+			changed = 1;
+		}
+	}
+
+	// only once exec'd, to have exec_ts
+	if (watch[n][0] == -1 && watch[n][1] != -1) {
+		while ((r = read(watch[n][1], buf, sizeof(buf))) > 0) {
+			if (memchr(buf, '\n', r) != NULL)
+				break;
+		}
+		if (r > 0) {
+			slog(LOG_INFO, "cmd is ready");
+			fc->ready = 1;
+			hist_add(&fc->exec_ready, &exec_ts[n], &now);
+		}
+		if (r != -1 || errno != EAGAIN) {
+			close(watch[n][1]);
+			watch[n][1] = -1;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+static void
+watch_close(int n)
+{
+	for (int i=0; i<2; i++) {
+		if (watch[n][i] != -1) {
+			close(watch[n][i]);
+			watch[n][i] = -1;
+		}
+	}
+}
+
+/*
+ * Add the time from `from' to `to' to a latency histogram.
+ */
+static void
+hist_add(struct fsv_hist *h, const struct timespec *from,
+         const struct timespec *to)
+{
+	long long us = (to->tv_sec - from->tv_sec) * 1000000LL +
+	    (to->tv_nsec - from->tv_nsec) / 1000;
+	int b = 0;
+
+	if (us < 0)
+		us = 0;
+	while (b < HIST_BUCKETS - 1 && us >= (2LL << b))
+		b++;
+
+	h->count++;
+	h->sum_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->bucket[b]++;
+}
+
+/*
+ * Work out a child's stdin, stdout, and stderr.
+ */
+static void
+chld_fds(int log, int logpipe[], long out_mask, int fd[])
+{
+	fd[0] = fd[1] = fd[2] = fd_devnull;
 	if (log == 0) {
 		switch (out_mask) {
 		case 0:
@@ -660,52 +2162,135 @@ fork_chld(int log, struct fsv_child *fc, int logpipe[], char *argv[],
 			// questionably useful, but allowed
 			break;
 		case 1:
-			fd1 = logpipe[1];
+			fd[1] = logpipe[1];
 			break;
 		case 2:
-			fd2 = logpipe[1];
+			fd[2] = logpipe[1];
 			break;
 		case 3:
-			fd1 = logpipe[1];
-			fd2 = logpipe[1];
+			fd[1] = logpipe[1];
+			fd[2] = logpipe[1];
 			break;
 		}
 	} else if (log == 1) {
-		fd0 = logpipe[0];
+		fd[0] = logpipe[0];
 	}
+}
 
-	// now fork
-	pid = fork();
-	if (pid == 0) {
-		// set up new fds
-		dup2(fd0, 0);
-		dup2(fd1, 1);
-		dup2(fd2, 2);
-		close(fd_devnull);
-		close(logpipe[0]);
-		close(logpipe[1]);
+/*
+ * In a child, set up its fds and signals and exec.
+ * If 'ctl' is not -1, wait for a byte from it before exec'ing.
+ * 'wr' are the write ends of the pipes from watch_pipes().
+ */
+static void
+chld_exec(int log, int fd[], int logpipe[], char *argv[], int ctl, int wr[])
+{
+	// set up new fds
+	dup2(fd[0], 0);
+	dup2(fd[1], 1);
+	dup2(fd[2], 2);
+	close(fd_devnull);
+	close(logpipe[0]);
+	close(logpipe[1]);
+
+	slog_close();
+
+	// unblock signals
+	sigprocmask(SIG_UNBLOCK, &bmask, NULL);
+
+	if (ctl != -1) {
+		char c;
+		if (read(ctl, &c, 1) != 1)
+			_exit(0);
+		close(ctl);
+	}
+
+	// the socket for --listen goes to fd 3
+	if (!log && listen_fd != -1)
+		od_child(listen_fd, wr);
+
+	// the ready pipe goes to --ready-fd and stays open across exec
+	if (wr[1] != -1) {
+		if (wr[0] == ready_fd)
+			wr[0] = fcntl(wr[0], F_DUPFD_CLOEXEC, ready_fd + 1);
+		if (wr[1] == ready_fd)
+			fcntl(ready_fd, F_SETFD, 0);
+		else
+			dup2(wr[1], ready_fd);
+	}
 
-		slog_close();
+	// as are --env and the memory policy
+	if (!log && cmd_env != NULL)
+		environ = cmd_env;
+	if (log || mem_apply() == 0)
+		exe_exec(log, argv);
 
-		// unblock signals
-		sigprocmask(SIG_UNBLOCK, &bmask, NULL);
+	// This runs only if the exec failed.
+	if (wr[0] != -1)
+		write(wr[0], "", 1);
 
-		execvp(argv[0], argv);
+	// <sysexits.h> EX_USAGE was chosen because it is a permanent
+	// failure that will never be fixed by simply re-execing anyway.
+	exit(64);
+}
 
-		// This runs only if the exec failed.
-		// <sysexits.h> EX_USAGE was chosen because it is a permanent
-		// failure that will never be fixed by simply re-execing anyway.
-		exit(64);
+/*
+ * The environment of fsv with the `nadd' NAME=VALUE strings in `add' on
+ * top, the last one winning. It is built up front, since a child of
+ * this multi-threaded process had better not allocate memory.
+ * Returns NULL if out of memory.
+ */
+static char **
+env_build(char *add[], int nadd)
+{
+	char **env;
+	int n = 0;
+
+	while (environ[n] != NULL)
+		n++;
+	env = malloc((n + nadd + 1) * sizeof(*env));
+	if (env == NULL)
+		return NULL;
+
+	n = 0;
+	for (char **e = environ; *e != NULL; e++) {
+		size_t len = strcspn(*e, "=");
+		int i;
+
+		for (i=0; i<nadd; i++)
+			if (strncmp(*e, add[i], len + 1) == 0)
+				break;
+		if (i == nadd)
+			env[n++] = *e;
 	}
+	for (int i=0; i<nadd; i++) {
+		size_t len = strcspn(add[i], "=");
+		int j;
 
-	if (pid == -1) {
-		fc->pid = 0;
-		return -1;
-	} else {
-		fc->pid = pid;
-		return 0;
+		for (j=i+1; j<nadd; j++)
+			if (strncmp(add[i], add[j], len + 1) == 0)
+				break;
+		if (j == nadd)
+			env[n++] = add[i];
 	}
+	env[n] = NULL;
+
+	return env;
+}
+
+#ifdef USE_SDT
+/*
+ * Nanoseconds since a CLOCK_MONOTONIC time, for probe arguments.
+ */
+static long long
+probe_ns(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000000LL +
+	    (now.tv_nsec - since->tv_nsec);
 }
+#endif
 
 // strtol(3) with errors;
 // only allow positive numbers
@@ -742,9 +2327,28 @@ str_to_l(const char *str)
 	return val;
 }
 
-void
-termprocs(struct fsv_child chld[])
+/*
+ * Send both processes SIGTERM, and wait a little for log to exit,
+ * so that the sink can take back what it didn't read.
+ * Returns true if there is no log process left.
+ */
+int
+termprocs(struct fsv_parent *fsv, struct fsv_child chld[])
 {
+	pid_t logpid = chld[1].pid;
+
+	// halfway through a replace
+	if (fsv->rep_old > 0) {
+		kill(fsv->rep_old, SIGTERM);
+		kill(fsv->rep_old, SIGCONT);
+		fsv->rep_old = 0;
+	}
+	if (rep_left > 0) {
+		kill(rep_left, SIGTERM);
+		kill(rep_left, SIGCONT);
+		rep_left = 0;
+	}
+
 	if (chld[0].pid > 0) {
 		kill(chld[0].pid, SIGTERM);
 		kill(chld[0].pid, SIGCONT);
@@ -754,8 +2358,29 @@ termprocs(struct fsv_child chld[])
 		kill(chld[1].pid, SIGCONT);
 	}
 
+	// a frozen cmd would not see the signal until thawed
+	if (chld[0].frozen) {
+		cg_freeze(0);
+		chld[0].frozen = 0;
+	}
+
 	chld[0].pid = 0;
 	chld[1].pid = 0;
+
+	for (int ms=0; logpid > 0; ms += 10) {
+		struct timespec ts = { 0, 10000000 };
+		pid_t r = waitpid(logpid, NULL, WNOHANG);
+
+		if (r == logpid || (r == -1 && errno == ECHILD))
+			return 1;
+		if (ms >= LOG_REAP_MS) {
+			slog(LOG_WARNING, "log process %ld did not exit",
+			    (long)logpid);
+			return 0;
+		}
+		nanosleep(&ts, NULL);
+	}
+	return 1;
 }
 
 void
@@ -769,20 +2394,42 @@ usage()
 void
 write_info(int fd, struct fsv_parent *fsv, struct fsv_child chld[])
 {
-	struct allinfo ai;
-	ai.fsv = *fsv;
-	ai.chld[0] = chld[0];
-	ai.chld[1] = chld[1];
+	FSV_PROBE4(write_info, svc_name, fsv->pid, chld[0].pid, chld[1].pid);
+
+	pthread_mutex_lock(&info_mtx);
+	lastinfo_fd = fd;
+	lastinfo.fsv = *fsv;
+	lastinfo.chld[0] = chld[0];
+	lastinfo.chld[1] = chld[1];
+	pthread_mutex_unlock(&info_mtx);
 
-	size_t size = sizeof(ai);
+	sync_info();
+}
+
+/*
+ * Write info.struct again with the latest shared data,
+ * for threads that update it outside of the main loop.
+ */
+void
+sync_info()
+{
+	size_t size = sizeof(lastinfo);
 	ssize_t written;
 
-	// the fd is long-lived, so lseek(2) to the beginning;
-	// should never fail in this circumstance
-	lseek(fd, 0, SEEK_SET);
+	pthread_mutex_lock(&info_mtx);
+	if (lastinfo_fd == -1) {
+		// main hasn't written it yet; it will
+		pthread_mutex_unlock(&info_mtx);
+		return;
+	}
+	lastinfo.store = storeinfo;
+	lastinfo.sink = sinkinfo;
+	lastinfo.fsv.slog_dropped = slog_dropped();
 
-	written = write(fd, &ai, size);
+	// the fd is long-lived, so always write at the beginning
+	written = pwrite(lastinfo_fd, &lastinfo, size, 0);
 	if (written == -1 || written != size) {
 		slog(LOG_WARNING, "write into info.struct failed: %m");
 	}
+	pthread_mutex_unlock(&info_mtx);
 }
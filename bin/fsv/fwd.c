@@ -0,0 +1,433 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Forwarding of cmd's output to a collector on a unix socket, for
+ * --forward. It runs in the sink thread, which hands it each line.
+ *
+ * Each line becomes a record `name seconds.micros line\n' that is added
+ * to a buffer of a fixed size. The buffer is sent once it holds a batch
+ * worth, or once its oldest line has waited FWD_DELAY_MS; with a stream
+ * socket as a run of bytes, with a datagram socket as one datagram per
+ * batch, cut after a record. The socket never blocks: when the collector
+ * doesn't keep up, records wait in the buffer, and once that is full new
+ * lines are dropped and counted, with a notice in their place when there
+ * is room again.
+ *
+ * When the collector goes away, fsv connects again after FWD_RETRY_MIN
+ * seconds, and up to FWD_RETRY_MAX apart after that. A record that was
+ * only partly sent over a stream is sent again in full, so the collector
+ * should ignore a line without its newline at the end of a connection.
+ */
+
+// bytes per batch, and the most in one datagram
+#define FWD_BATCH	16384
+// how long a line may wait for a batch to fill up
+#define FWD_DELAY_MS	200
+// seconds between tries to connect
+#define FWD_RETRY_MIN	1
+#define FWD_RETRY_MAX	30
+// how long to keep trying to send what is left when stopping
+#define FWD_CLOSE_MS	1000
+
+static struct sockaddr_un fwd_sun;
+static const char *fwd_name;
+static int fwd_fd = -1;
+
+// records go in at flen and out at foff; frec is where the first record
+// not fully sent begins, foff may be past it
+static char *fbuf;
+static size_t fsize;
+static size_t frec = 0;
+static size_t foff = 0;
+static size_t flen = 0;
+
+// when the oldest record waiting came in
+static struct timespec first;
+// set when the collector didn't take everything
+static int stalled = 0;
+
+// when to try to connect next, and the wait after that
+static struct timespec retry_at;
+static int retry_secs = FWD_RETRY_MIN;
+
+// lines dropped since the last notice
+static long long lost = 0;
+
+// the thread's copy of the counters, published by the sink
+static struct fsv_fwd fs;
+
+static long
+ms_since(const struct timespec *t, const struct timespec *now)
+{
+	return (now->tv_sec - t->tv_sec) * 1000 +
+	    (now->tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void
+fwd_retry(const struct timespec *now)
+{
+	retry_at = *now;
+	retry_at.tv_sec += retry_secs;
+	retry_secs *= 2;
+	if (retry_secs > FWD_RETRY_MAX)
+		retry_secs = FWD_RETRY_MAX;
+}
+
+/*
+ * Try to connect, as a stream socket or else as a datagram one.
+ */
+static void
+fwd_connect(const struct timespec *now)
+{
+	int type = SOCK_STREAM;
+
+	while (1) {
+		fwd_fd = socket(AF_UNIX, type|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+		if (fwd_fd == -1) {
+			fs.last_errno = errno;
+			break;
+		}
+		if (connect(fwd_fd, (struct sockaddr *)&fwd_sun,
+		    sizeof(fwd_sun)) == 0) {
+			if (fs.connects > 0)
+				slog(LOG_NOTICE, "connected to %s again",
+				    fs.path);
+			fs.connects++;
+			fs.connected = 1;
+			fs.last_errno = 0;
+			fs.dgram = (type == SOCK_DGRAM);
+			retry_secs = FWD_RETRY_MIN;
+			stalled = 0;
+			return;
+		}
+		fs.last_errno = errno;
+		close(fwd_fd);
+		fwd_fd = -1;
+		if (errno != EPROTOTYPE || type == SOCK_DGRAM)
+			break;
+		type = SOCK_DGRAM;
+	}
+
+	// only complain once per outage
+	if (retry_secs == FWD_RETRY_MIN) {
+		errno = fs.last_errno;
+		slog(LOG_WARNING, "cannot connect to %s: %m", fs.path);
+	}
+	fwd_retry(now);
+}
+
+static void
+fwd_disconnect(const struct timespec *now)
+{
+	errno = fs.last_errno;
+	slog(LOG_WARNING, "lost connection to %s: %m", fs.path);
+	close(fwd_fd);
+	fwd_fd = -1;
+	fs.connected = 0;
+	foff = frec;
+	stalled = 0;
+	fwd_retry(now);
+}
+
+/*
+ * Send as much of the buffer as the collector takes right now.
+ */
+static void
+fwd_send(const struct timespec *now)
+{
+	while (foff < flen) {
+		size_t n = flen - foff;
+		const char *nl;
+		ssize_t w;
+
+		if (fs.dgram) {
+			// a whole number of records, at most a batch
+			if (n > FWD_BATCH)
+				n = FWD_BATCH;
+			for (nl = NULL; n > 0 && nl == NULL; n--)
+				if (fbuf[foff + n - 1] == '\n')
+					nl = fbuf + foff + n;
+			n = nl - (fbuf + foff);
+		}
+
+		w = send(fwd_fd, fbuf + foff, n, MSG_NOSIGNAL);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == ENOBUFS) {
+				if (!stalled)
+					fs.stalls++;
+				stalled = 1;
+				fs.buffered = flen - frec;
+				return;
+			}
+			fs.last_errno = errno;
+			fwd_disconnect(now);
+			return;
+		}
+		stalled = 0;
+		fs.batches++;
+		fs.bytes += w;
+
+		// count the records that made it all the way
+		for (const char *p = fbuf + foff, *end = p + w;
+		    (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+			fs.lines++;
+			frec = nl + 1 - fbuf;
+		}
+		foff += w;
+	}
+
+	frec = foff = flen = 0;
+	fs.buffered = 0;
+}
+
+/*
+ * Add a record, making room for it first.
+ * Returns -1 if it doesn't fit.
+ */
+static int
+fwd_put(const struct timespec *ts, const char *s, size_t len)
+{
+	char hdr[64];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr), " %lld.%06ld ", (long long)ts->tv_sec,
+	    ts->tv_nsec / 1000);
+	size_t need = strlen(fwd_name) + n + len + 1;
+
+	if (need > fsize - flen && frec > 0) {
+		memmove(fbuf, fbuf + frec, flen - frec);
+		foff -= frec;
+		flen -= frec;
+		frec = 0;
+	}
+	if (need > fsize - flen)
+		return -1;
+
+	if (flen == foff)
+		first = *ts;
+	memcpy(fbuf + flen, fwd_name, strlen(fwd_name));
+	flen += strlen(fwd_name);
+	memcpy(fbuf + flen, hdr, n);
+	flen += n;
+	memcpy(fbuf + flen, s, len);
+	flen += len;
+	fbuf[flen++] = '\n';
+
+	fs.buffered = flen - frec;
+	if (fs.buffered > fs.buffered_peak)
+		fs.buffered_peak = fs.buffered;
+	return 0;
+}
+
+/*
+ * Forward to the unix socket at `path', as service `name', with a
+ * buffer of `kib'.
+ */
+int
+fwd_open(const char *path, const char *name, long kib)
+{
+	struct timespec now;
+
+	if (strlen(path) >= sizeof(fwd_sun.sun_path)) {
+		slog(LOG_ERR, "--forward path too long");
+		return -1;
+	}
+	memset(&fwd_sun, 0, sizeof(fwd_sun));
+	fwd_sun.sun_family = AF_UNIX;
+	strcpy(fwd_sun.sun_path, path);
+	fwd_name = name;
+
+	fsize = kib * 1024;
+	fbuf = malloc(fsize);
+	if (fbuf == NULL) {
+		slog(LOG_ERR, "malloc() failed: %m");
+		return -1;
+	}
+
+	fs.enabled = 1;
+	strcpy(fs.path, path);
+	fs.buffer_kib = kib;
+
+	// the collector may well come up later
+	clock_gettime(CLOCK_REALTIME, &now);
+	fwd_connect(&now);
+	return 0;
+}
+
+/*
+ * Say how many lines were dropped, once there is room for it.
+ */
+static void
+fwd_notice(const struct timespec *ts)
+{
+	char msg[96];
+	int n;
+
+	if (lost == 0)
+		return;
+	n = snprintf(msg, sizeof(msg),
+	    "fsv: forward buffer full, dropped %lld lines", lost);
+	if (fwd_put(ts, msg, n) == 0)
+		lost = 0;
+}
+
+/*
+ * Forward one line of output, without its newline.
+ */
+void
+fwd_append(const struct timespec *ts, const char *s, size_t len)
+{
+	fwd_notice(ts);
+	if (lost == 0 && fwd_put(ts, s, len) == 0) {
+		// a small buffer makes for small batches
+		if (fwd_fd != -1 && !stalled && (flen - foff >= FWD_BATCH ||
+		    flen - foff >= fsize / 2))
+			fwd_send(ts);
+		return;
+	}
+
+	// full: send what is there early, if the collector takes it
+	if (fwd_fd != -1 && !stalled) {
+		fwd_send(ts);
+		fwd_notice(ts);
+		if (lost == 0 && fwd_put(ts, s, len) == 0)
+			return;
+	}
+	fs.dropped++;
+	lost++;
+}
+
+/*
+ * The fd to poll(2), -1 if none, and what for: POLLOUT if the collector
+ * has to catch up, otherwise only to see it hang up.
+ */
+int
+fwd_pollfd(short *events)
+{
+	*events = stalled ? POLLOUT : 0;
+	return fwd_fd;
+}
+
+/*
+ * How long to wait at most, in ms, given that the sink would wait
+ * `tmout', -1 for ever, so that fwd_run() comes in time.
+ */
+int
+fwd_timeout(const struct timespec *now, int tmout)
+{
+	long ms;
+
+	if (fwd_fd == -1)
+		ms = -ms_since(&retry_at, now);
+	else if (!stalled && foff < flen)
+		ms = FWD_DELAY_MS - ms_since(&first, now);
+	else
+		return tmout;
+
+	if (ms < 0)
+		ms = 0;
+	return (tmout == -1 || ms < tmout) ? ms : tmout;
+}
+
+/*
+ * Connect or send if it is time to. `revents' is what poll(2) said
+ * about the fd from fwd_pollfd().
+ * Returns true if it did either.
+ */
+int
+fwd_run(const struct timespec *now, int revents)
+{
+	int did = 0;
+
+	if (fwd_fd != -1 && (revents & (POLLHUP|POLLERR)) && !stalled) {
+		fs.last_errno = ECONNRESET;
+		fwd_disconnect(now);
+	}
+	if (fwd_fd == -1) {
+		if (ms_since(&retry_at, now) < 0)
+			return 0;
+		fwd_connect(now);
+		if (fwd_fd == -1)
+			return 1;
+		did = 1;
+	}
+	fwd_notice(now);
+	if (foff == flen)
+		return did;
+	if (stalled ? revents == 0 :
+	    ms_since(&first, now) < FWD_DELAY_MS)
+		return did;
+	fwd_send(now);
+	return 1;
+}
+
+/*
+ * Copy the counters out, for info.struct.
+ */
+void
+fwd_stats(struct fsv_fwd *f)
+{
+	*f = fs;
+}
+
+/*
+ * Send what is left, waiting for the collector a little, and close.
+ */
+void
+fwd_close()
+{
+	struct timespec now, t0;
+	long long left = 0;
+
+	clock_gettime(CLOCK_REALTIME, &t0);
+	now = t0;
+	if (fwd_fd == -1 && foff < flen)
+		fwd_connect(&now);
+	while (fwd_fd != -1 && foff < flen) {
+		long ms = FWD_CLOSE_MS - ms_since(&t0, &now);
+		struct pollfd pfd = { fwd_fd, POLLOUT, 0 };
+
+		if (ms <= 0)
+			break;
+		if (stalled && poll(&pfd, 1, ms) <= 0)
+			break;
+		stalled = 0;
+		fwd_send(&now);
+		clock_gettime(CLOCK_REALTIME, &now);
+	}
+
+	for (const char *p = fbuf + frec, *nl;
+	    (nl = memchr(p, '\n', fbuf + flen - p)) != NULL; p = nl + 1)
+		left++;
+	if (left > 0) {
+		slog(LOG_WARNING, "%lld lines not forwarded to %s", left,
+		    fs.path);
+		fs.dropped += left;
+	}
+	fs.buffered = 0;
+
+	if (fwd_fd != -1)
+		close(fwd_fd);
+	fwd_fd = -1;
+	fs.connected = 0;
+	free(fbuf);
+	fbuf = NULL;
+}
@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "extern.h"
+
+/*
+ * A small, fast LZ77 compressor for log store segments.
+ * The block format follows LZ4: a sequence of
+ *
+ *	token, [literal length bytes], literals,
+ *	offset (2 bytes LE), [match length bytes]
+ *
+ * where the token holds the literal length in its high nibble and the match
+ * length minus LZ_MINMATCH in its low one, and 15 in either nibble means
+ * more length bytes follow (255 meaning "keep going").
+ * The final sequence stops after its literals.
+ *
+ * It is not meant to be compatible with anything, only to be simple,
+ * dependency-free, and quick enough to keep up with a busy log.
+ */
+
+#define LZ_HASH_BITS	12
+#define LZ_MINMATCH	4
+#define LZ_MAXOFF	65535
+
+static uint32_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Write an extended length; returns the new dst position or NULL if full.
+ */
+static unsigned char *
+put_len(unsigned char *op, unsigned char *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *
+put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+        size_t litlen, size_t off, size_t mlen)
+{
+	unsigned char *token;
+
+	if (op >= oend)
+		return NULL;
+	token = op++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+
+	if (litlen >= 15 && (op = put_len(op, oend, litlen - 15)) == NULL)
+		return NULL;
+	if ((size_t)(oend - op) < litlen)
+		return NULL;
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	// last sequence: literals only
+	if (mlen == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+
+	mlen -= LZ_MINMATCH;
+	*token |= (mlen >= 15 ? 15 : mlen);
+	if (mlen >= 15 && (op = put_len(op, oend, mlen - 15)) == NULL)
+		return NULL;
+
+	return op;
+}
+
+/*
+ * Compress `n' bytes from `src' into `dst'.
+ * Returns the compressed size, or 0 if it would not fit in `cap' bytes.
+ */
+size_t
+lz_compress(const unsigned char *src, size_t n, unsigned char *dst,
+            size_t cap)
+{
+	// positions + 1, so that 0 means empty
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *anchor = src;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + cap;
+	size_t ip = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (n >= LZ_MINMATCH && ip <= n - LZ_MINMATCH) {
+		uint32_t v = read32(src + ip);
+		unsigned h = lz_hash(v);
+		size_t ref = table[h];
+		table[h] = ip + 1;
+
+		if (ref == 0 || ip - (ref - 1) > LZ_MAXOFF ||
+		    read32(src + ref - 1) != v) {
+			ip++;
+			continue;
+		}
+		ref--;
+
+		size_t mlen = LZ_MINMATCH;
+		while (ip + mlen < n && src[ref + mlen] == src[ip + mlen])
+			mlen++;
+
+		op = put_seq(op, oend, anchor, (src + ip) - anchor,
+		    ip - ref, mlen);
+		if (op == NULL)
+			return 0;
+
+		ip += mlen;
+		anchor = src + ip;
+	}
+
+	op = put_seq(op, oend, anchor, (src + n) - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+
+	return op - dst;
+}
+
+/*
+ * Decompress `n' bytes from `src' into `dst'.
+ * Returns the decompressed size, or -1 if the data is corrupt or would
+ * not fit in `cap' bytes.
+ */
+ssize_t
+lz_decompress(const unsigned char *src, size_t n, unsigned char *dst,
+              size_t cap)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + n;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t len = token >> 4;
+
+		if (len == 15) {
+			unsigned b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+			return -1;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return -1;
+
+		len = (token & 15) + LZ_MINMATCH;
+		if ((token & 15) == 15) {
+			unsigned b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if ((size_t)(oend - op) < len)
+			return -1;
+
+		// may overlap, so copy forwards byte by byte
+		const unsigned char *m = op - off;
+		for (size_t i=0; i<len; i++)
+			op[i] = m[i];
+		op += len;
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,224 @@
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#include <sys/resource.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Memory policy for cmd: transparent huge pages, KSM, the NUMA policy,
+ * and the locked-memory limit, applied in the child right before exec,
+ * so that no wrapper is needed. All of them are kept across exec.
+ *
+ * mem_init() checks the policy up front, in fsv, so that mistakes show up
+ * as such rather than as cmd failing to start; mem_apply() only makes
+ * system calls, and is safe to call after fork().
+ */
+
+#ifdef __linux__
+// Linux 6.4; not in older headers
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE	67
+#define PR_GET_MEMORY_MERGE	68
+#endif
+#endif
+
+static const struct fsv_mem *mem;
+#ifdef __linux__
+static int numa_mode;
+static unsigned long numa_nodes;
+#endif
+
+/*
+ * Parse a node list like "0-1,3" into a mask.
+ */
+static int
+parse_nodes(const char *s, unsigned long *mask)
+{
+	const int max = sizeof(*mask) * 8;
+	char *end;
+	long lo, hi;
+
+	*mask = 0;
+	while (*s != '\0') {
+		lo = hi = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+		s = end;
+		if (*s == '-') {
+			s++;
+			hi = strtol(s, &end, 10);
+			if (end == s)
+				return -1;
+			s = end;
+		}
+		if (lo < 0 || hi >= max || lo > hi)
+			return -1;
+		for (long n=lo; n<=hi; n++)
+			*mask |= 1UL << n;
+		if (*s == ',')
+			s++;
+		else if (*s != '\0')
+			return -1;
+	}
+	return *mask == 0 ? -1 : 0;
+}
+
+/*
+ * Check `m' and remember it for mem_apply().
+ * Returns -1 after complaining if it can't be applied.
+ */
+int
+mem_init(const struct fsv_mem *m)
+{
+	if (!m->thp_disable && !m->ksm && m->numa[0] == '\0' &&
+	    !m->memlock)
+		return 0;
+
+#ifdef __linux__
+	if (m->thp_disable && prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0) == -1) {
+		slog(LOG_ERR, "--thp-disable is not supported: %m");
+		return -1;
+	}
+	if (m->ksm && prctl(PR_GET_MEMORY_MERGE, 0, 0, 0, 0) == -1) {
+		slog(LOG_ERR, "--ksm is not supported: %m");
+		return -1;
+	}
+
+	if (m->numa[0] != '\0') {
+		const char *nodes = strchr(m->numa, ':');
+		size_t len = nodes ? nodes - m->numa : strlen(m->numa);
+
+		if (strncmp(m->numa, "bind", len) == 0 && len == 4)
+			numa_mode = MPOL_BIND;
+		else if (strncmp(m->numa, "interleave", len) == 0 && len == 10)
+			numa_mode = MPOL_INTERLEAVE;
+		else if (strncmp(m->numa, "preferred", len) == 0 && len == 9)
+			numa_mode = MPOL_PREFERRED;
+		else {
+			slog(LOG_ERR, "unrecognized policy for --numa");
+			return -1;
+		}
+		if (nodes == NULL || parse_nodes(nodes + 1, &numa_nodes) == -1) {
+			slog(LOG_ERR, "bad node list for --numa");
+			return -1;
+		}
+		for (int n=0; n<sizeof(numa_nodes)*8; n++) {
+			char path[64];
+
+			if (!(numa_nodes & (1UL << n)))
+				continue;
+			snprintf(path, sizeof(path),
+			    "/sys/devices/system/node/node%d", n);
+			if (access(path, F_OK) == -1) {
+				slog(LOG_ERR, "no NUMA node %d", n);
+				return -1;
+			}
+		}
+	}
+#else
+	if (m->thp_disable || m->ksm || m->numa[0] != '\0') {
+		slog(LOG_ERR, "memory policy is not supported on this system");
+		return -1;
+	}
+#endif
+
+	if (m->memlock) {
+		struct rlimit rl;
+
+		if (getrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+			slog(LOG_ERR, "getrlimit(RLIMIT_MEMLOCK) failed: %m");
+			return -1;
+		}
+		// Raising the hard limit takes privilege, so see if it can be
+		// done by raising that of fsv; cmd would inherit it anyway.
+		if (rl.rlim_max != RLIM_INFINITY && (m->memlock_kib == -1 ||
+		    m->memlock_kib * 1024 > rl.rlim_max)) {
+			struct rlimit want = rl;
+
+			want.rlim_max = m->memlock_kib == -1 ? RLIM_INFINITY :
+			    m->memlock_kib * 1024;
+			if (setrlimit(RLIMIT_MEMLOCK, &want) == -1) {
+				slog(LOG_ERR, "--memlock is over the hard limit "
+				    "of %lld KiB: %m", (long long)rl.rlim_max / 1024);
+				return -1;
+			}
+		}
+	}
+
+	mem = m;
+	return 0;
+}
+
+/*
+ * Write a message about what failed to stderr, which is cmd's output.
+ */
+static void
+mem_fail(const char *msg)
+{
+	write(2, "fsv: ", 5);
+	write(2, msg, strlen(msg));
+	write(2, " failed\n", 8);
+}
+
+/*
+ * In a cmd child, before exec: apply the memory policy.
+ * Returns -1 if that fails; cmd should then not be run.
+ */
+int
+mem_apply()
+{
+	if (mem == NULL)
+		return 0;
+
+#ifdef __linux__
+	if (mem->thp_disable && prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0) == -1) {
+		mem_fail("prctl(PR_SET_THP_DISABLE)");
+		return -1;
+	}
+	if (mem->ksm && prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) == -1) {
+		mem_fail("prctl(PR_SET_MEMORY_MERGE)");
+		return -1;
+	}
+	// the kernel ignores the last bit of maxnode
+	if (numa_mode != 0 && syscall(SYS_set_mempolicy, numa_mode,
+	    &numa_nodes, sizeof(numa_nodes) * 8 + 1) == -1) {
+		mem_fail("set_mempolicy()");
+		return -1;
+	}
+#endif
+
+	if (mem->memlock) {
+		struct rlimit rl;
+
+		if (getrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+			mem_fail("getrlimit(RLIMIT_MEMLOCK)");
+			return -1;
+		}
+		if (mem->memlock_kib == -1)
+			rl.rlim_cur = RLIM_INFINITY;
+		else
+			rl.rlim_cur = mem->memlock_kib * 1024;
+		// raise the hard limit only if needed, which takes root
+		if (rl.rlim_max != RLIM_INFINITY &&
+		    (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > rl.rlim_max))
+			rl.rlim_max = rl.rlim_cur;
+		if (setrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+			mem_fail("setrlimit(RLIMIT_MEMLOCK)");
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * On-demand mode, for --listen.
+ *
+ * fsv holds the listening socket of the service and only starts cmd once
+ * a connection comes in; it is passed to cmd as fd 3, the way systemd
+ * does it, with LISTEN_FDS and LISTEN_PID. A connection that comes while
+ * cmd is starting, or stopped, simply waits in the backlog.
+ *
+ * With --idle, cmd is stopped again once it has had no connections for
+ * that long. fsv doesn't see the connections that cmd accepts, so it
+ * looks them up in /proc/net by the address of the socket.
+ */
+
+// the fd cmd gets the socket as
+#define OD_FD	3
+
+// in the environment; LISTEN_PID is filled in by each cmd child
+static char env_fds[] = "LISTEN_FDS=1";
+static char env_pid[32] = "LISTEN_PID=0";
+
+// what to look for in /proc/net
+static int od_unix;
+static char od_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static unsigned od_port;
+
+/*
+ * Open the socket to listen on `addr': a path for a unix socket,
+ * or [host:]port for TCP.
+ * Returns the fd, or -1 after complaining.
+ */
+int
+od_listen(const char *addr)
+{
+	int fd;
+
+	if (*addr == '/') {
+		struct sockaddr_un sun;
+		struct stat st;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			slog(LOG_ERR, "--listen path too long");
+			return -1;
+		}
+		strcpy(sun.sun_path, addr);
+		strcpy(od_path, addr);
+		od_unix = 1;
+
+		// left behind by an earlier fsv
+		if (lstat(addr, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			slog(LOG_ERR, "socket() failed: %m");
+			return -1;
+		}
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			slog(LOG_ERR, "bind(%s) failed: %m", addr);
+			close(fd);
+			return -1;
+		}
+	} else {
+		struct addrinfo hints, *res, *ai;
+		char host[256];
+		const char *port = strrchr(addr, ':');
+		int e, on = 1;
+
+		if (port == NULL) {
+			host[0] = '\0';
+			port = addr;
+		} else {
+			snprintf(host, sizeof(host), "%.*s",
+			    (int)(port - addr), addr);
+			port++;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		e = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+		if (e != 0) {
+			slog(LOG_ERR, "--listen %s: %s", addr, gai_strerror(e));
+			return -1;
+		}
+
+		fd = -1;
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+			    ai->ai_protocol);
+			if (fd == -1)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd == -1) {
+			slog(LOG_ERR, "bind(%s) failed: %m", addr);
+			return -1;
+		}
+		od_port = strtoul(port, NULL, 10);
+	}
+
+	if (listen(fd, SOMAXCONN) == -1) {
+		slog(LOG_ERR, "listen() failed: %m");
+		close(fd);
+		return -1;
+	}
+
+	putenv(env_fds);
+	putenv(env_pid);
+	return fd;
+}
+
+/*
+ * Ask for SIGIO when a connection comes in.
+ * cmd shares the flags of the socket and may have cleared O_ASYNC,
+ * so this is done again every time cmd goes idle.
+ */
+void
+od_arm(int fd)
+{
+	fcntl(fd, F_SETOWN, getpid());
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC);
+}
+
+/*
+ * True if a connection is waiting to be accepted.
+ */
+int
+od_pending(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Count the connections to our port in one of /proc/net/tcp{,6}.
+ */
+static int
+count_tcp(const char *file)
+{
+	char line[256];
+	unsigned port, st;
+	int n = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return 0;
+	// sl local_address rem_address st ...; addresses are ADDR:PORT in hex
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *c = strchr(line, ':');
+		if (c == NULL || (c = strchr(c + 1, ':')) == NULL)
+			continue;
+		if (sscanf(c + 1, "%x %*s %x", &port, &st) != 2)
+			continue;
+		// anything but LISTEN, TIME_WAIT, and CLOSE
+		if (port == od_port && st != 0x0A && st != 0x06 && st != 0x07)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/*
+ * Count the connections to our path in /proc/net/unix;
+ * accepted sockets are listed with the address of the listener.
+ */
+static int
+count_unix()
+{
+	char line[512];
+	char path[sizeof(line)];
+	unsigned st;
+	int n = 0;
+	FILE *f;
+
+	f = fopen("/proc/net/unix", "r");
+	if (f == NULL)
+		return 0;
+	// Num RefCount Protocol Flags Type St Inode Path
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%*s %*s %*s %*s %*s %x %*s %s", &st, path)
+		    != 2)
+			continue;
+		// SS_CONNECTED
+		if (st == 3 && strcmp(path, od_path) == 0)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/*
+ * True if cmd has any connections, or some are waiting for it.
+ */
+int
+od_busy(int fd)
+{
+	if (od_pending(fd))
+		return 1;
+	if (od_unix)
+		return count_unix() > 0;
+	return count_tcp("/proc/net/tcp") + count_tcp("/proc/net/tcp6") > 0;
+}
+
+/*
+ * In a cmd child: put the socket at OD_FD and say so in LISTEN_PID.
+ * `wr' are fds to keep out of its way.
+ * Only uses system calls, so is safe to call after fork().
+ */
+void
+od_child(int fd, int wr[])
+{
+	char digits[16];
+	char *c = env_pid + strlen("LISTEN_PID=");
+	int n = 0;
+	long pid = getpid();
+
+	for (int i=0; i<2; i++)
+		if (wr[i] == OD_FD)
+			wr[i] = fcntl(wr[i], F_DUPFD_CLOEXEC, OD_FD + 1);
+	if (fd == OD_FD)
+		fcntl(OD_FD, F_SETFD, 0);
+	else
+		dup2(fd, OD_FD);
+
+	do {
+		digits[n++] = '0' + pid % 10;
+		pid /= 10;
+	} while (pid > 0);
+	while (n > 0)
+		*c++ = digits[--n];
+	*c = '\0';
+}
@@ -0,0 +1,175 @@
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>	// for LOG_* level constants
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Restart policy of cmd by how it ended, for --on-exit.
+ *
+ * Each way cmd can end is first classified: it couldn't be executed, it
+ * exited with a code, or it was killed by a signal. The action for it is
+ * then looked up in per-code and per-signal tables, which --on-exit
+ * fills in. Without rules, everything is restarted as usual, except an
+ * exec failure, which would only fail again: that gives up, like
+ * exceeding max_recent_execs does.
+ */
+
+static const char *pol_names[] = { "restart", "now", "done", "giveup" };
+
+static int pol_exec = POL_GIVEUP;
+static int pol_code[256];
+static int pol_sig[NSIG];
+
+static const struct {
+	const char *name;
+	int sig;
+} sigs[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+	{ "ILL", SIGILL }, { "TRAP", SIGTRAP }, { "ABRT", SIGABRT },
+	{ "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+	{ "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+	{ "SYS", SIGSYS }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+	{ NULL, 0 }
+};
+
+/*
+ * A signal by name, with or without SIG, or by number.
+ */
+static int
+sig_parse(const char *s)
+{
+	char *end;
+	long n;
+
+	if (strncasecmp(s, "SIG", 3) == 0)
+		s += 3;
+	for (int i=0; sigs[i].name != NULL; i++)
+		if (strcasecmp(s, sigs[i].name) == 0)
+			return sigs[i].sig;
+	n = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || n <= 0 || n >= NSIG)
+		return -1;
+	return n;
+}
+
+/*
+ * Add a rule `what[,what...]=action', where each `what' is `exec', an
+ * exit code or range of them like `1-9', `signal' for all signals, or
+ * a signal.
+ * Returns -1 after complaining if it doesn't parse.
+ */
+int
+pol_parse(const char *rule)
+{
+	const char *eq = strrchr(rule, '=');
+	char *list, *what, *last;
+	int action = -1;
+
+	if (eq == NULL) {
+		slog(LOG_ERR, "--on-exit must be what=action");
+		return -1;
+	}
+	for (int i=0; i<4; i++)
+		if (strcmp(eq + 1, pol_names[i]) == 0)
+			action = i;
+	if (action == -1) {
+		slog(LOG_ERR, "unrecognized action `%s' for --on-exit", eq + 1);
+		return -1;
+	}
+
+	list = strndup(rule, eq - rule);
+	if (list == NULL) {
+		slog(LOG_ERR, "strndup() failed: %m");
+		exit(1);
+	}
+	for (what = strtok_r(list, ",", &last); what != NULL;
+	    what = strtok_r(NULL, ",", &last)) {
+		char *end;
+		long lo, hi;
+		int sig;
+
+		if (strcmp(what, "exec") == 0) {
+			pol_exec = action;
+			continue;
+		}
+		if (strcmp(what, "signal") == 0) {
+			for (int s=1; s<NSIG; s++)
+				pol_sig[s] = action;
+			continue;
+		}
+		lo = hi = strtol(what, &end, 10);
+		if (end != what && *end == '-')
+			hi = strtol(end + 1, &end, 10);
+		if (end != what && *end == '\0') {
+			if (lo < 0 || hi > 255 || lo > hi) {
+				slog(LOG_ERR, "bad exit code `%s' for --on-exit",
+				    what);
+				goto bad;
+			}
+			for (long c=lo; c<=hi; c++)
+				pol_code[c] = action;
+			continue;
+		}
+		sig = sig_parse(what);
+		if (sig == -1) {
+			slog(LOG_ERR, "unrecognized `%s' for --on-exit", what);
+			goto bad;
+		}
+		pol_sig[sig] = action;
+	}
+	free(list);
+	return 0;
+
+bad:
+	free(list);
+	return -1;
+}
+
+/*
+ * Classify how child `fc' ended, from its wait status and whether it
+ * said that exec failed, and record it.
+ * Returns the action to take, POL_*.
+ */
+int
+pol_classify(struct fsv_child *fc, int status, int exec_failed)
+{
+	int action = POL_RESTART;
+
+	if (exec_failed) {
+		fc->last_reason = EXIT_EXEC;
+		fc->last_code = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+		fc->exec_fails++;
+		action = pol_exec;
+	} else if (WIFEXITED(status)) {
+		fc->last_reason = EXIT_CODE;
+		fc->last_code = WEXITSTATUS(status);
+		if (fc->last_code == 0)
+			fc->exits_ok++;
+		else
+			fc->exits_err++;
+		action = pol_code[fc->last_code];
+	} else if (WIFSIGNALED(status)) {
+		fc->last_reason = EXIT_SIGNAL;
+		fc->last_code = WTERMSIG(status);
+		fc->exits_sig++;
+		if (fc->last_code < NSIG)
+			action = pol_sig[fc->last_code];
+	}
+	fc->last_action = action;
+	return action;
+}
+
+const char *
+pol_name(int action)
+{
+	return pol_names[action];
+}
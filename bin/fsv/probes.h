@@ -0,0 +1,39 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static tracepoints, for bpftrace(8), perf(1), and friends.
+ *
+ * Built with USE_SDT, these are USDT probes in provider `fsv' from
+ * <sys/sdt.h>: a single nop each, plus a note that tells the tracer where
+ * the probe is and where its arguments live.
+ * Otherwise they compile to nothing.
+ *
+ * Every probe has the service name as its first argument.
+ * `which' is 0 for cmd and 1 for log; times are in nanoseconds.
+ *
+ *	fork_entry(name, which, total_execs)
+ *	fork_return(name, which, pid, fork_ns)	pid is -1 if fork failed
+ *	reap(name, which, pid, wstatus, run_ns)
+ *	restart_limit(name, which, recent_execs, max_recent_execs, action)
+ *		action is 0 to give up, 1 to time out
+ *	giveup(name, which)
+ *	timeout_arm(name, which, ns)
+ *	write_info(name, fsv_pid, cmd_pid, log_pid)
+ */
+
+#ifdef USE_SDT
+#include <sys/sdt.h>
+
+#define FSV_PROBE2(p, a, b)		DTRACE_PROBE2(fsv, p, a, b)
+#define FSV_PROBE3(p, a, b, c)		DTRACE_PROBE3(fsv, p, a, b, c)
+#define FSV_PROBE4(p, a, b, c, d)	DTRACE_PROBE4(fsv, p, a, b, c, d)
+#define FSV_PROBE5(p, a, b, c, d, e)	DTRACE_PROBE5(fsv, p, a, b, c, d, e)
+#else
+#define FSV_PROBE2(p, a, b)
+#define FSV_PROBE3(p, a, b, c)
+#define FSV_PROBE4(p, a, b, c, d)
+#define FSV_PROBE5(p, a, b, c, d, e)
+#endif
+
+#endif // !_PROBES_H_
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Pressure stall information, for holding off restarts of cmd
+ * while the host (or fsv's own cgroup) is short on CPU, memory, or IO.
+ *
+ * The "some avg10" figure of each resource is compared with its threshold:
+ * the percentage of the last 10 seconds in which at least one task was
+ * stalled waiting for it.
+ * PSI is Linux-only; elsewhere, or if the kernel lacks it,
+ * there is never any pressure.
+ */
+
+static const char *psi_names[] = { "cpu", "memory", "io" };
+
+// directory with the pressure files, and their names in it
+static char psi_dir[256];
+static const char *psi_fmt;
+
+/*
+ * Pick where to read pressure from.
+ * fsv's cgroup is preferred, since that is where cmd runs,
+ * and falls back on the system-wide figures.
+ */
+void
+psi_init()
+{
+#ifdef __linux__
+	char dir[sizeof(psi_dir)];
+	char path[sizeof(psi_dir) + 32];
+
+	strcpy(psi_dir, "/proc/pressure");
+	psi_fmt = "%s/%s";
+
+	if (cg_path(0, dir, sizeof(dir)) == 0) {
+		snprintf(path, sizeof(path), "%s/cpu.pressure", dir);
+		if (access(path, R_OK) == 0) {
+			strcpy(psi_dir, dir);
+			psi_fmt = "%s/%s.pressure";
+		}
+	}
+	slog(LOG_DEBUG, "reading pressure from %s", psi_dir);
+#endif
+}
+
+/*
+ * Read "some avg10" of a resource; -1 if unavailable.
+ */
+static double
+psi_avg10(const char *res)
+{
+	char path[sizeof(psi_dir) + 32];
+	char line[128];
+	double avg = -1;
+	FILE *f;
+
+	if (psi_fmt == NULL)
+		return -1;
+
+	snprintf(path, sizeof(path), psi_fmt, psi_dir, res);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "some avg10=%lf", &avg) == 1)
+			break;
+	}
+	fclose(f);
+	return avg;
+}
+
+/*
+ * Check pressure against the thresholds in `limit' (cpu, memory, io;
+ * percent, 0 to ignore).
+ * Returns 1 if any is exceeded, with the reason written into `why',
+ * or 0 if cmd may be started.
+ */
+int
+psi_check(const long limit[3], char *why, size_t len)
+{
+	for (int i=0; i<3; i++) {
+		double avg;
+
+		if (limit[i] == 0)
+			continue;
+		avg = psi_avg10(psi_names[i]);
+		if (avg >= limit[i]) {
+			snprintf(why, len, "%s pressure %.2f%% >= %ld%%",
+			    psi_names[i], avg, limit[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
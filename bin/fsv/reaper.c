@@ -0,0 +1,192 @@
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Subreaper mode, for daemons that fork into the background.
+ *
+ * fsv becomes a child subreaper, so that when the process it started
+ * exits, whatever that left behind is reparented to fsv instead of init.
+ * The real main process is then found, from a pidfile or as the only
+ * child fsv didn't start itself, and fsv follows it instead:
+ * only its exit counts as cmd exiting.
+ *
+ * No pidfd is needed to follow it safely: the main process is a child
+ * of fsv, so its pid can't be reused before fsv reaps it, and its exit
+ * comes as SIGCHLD like any other.
+ */
+
+// how long to wait for the pidfile to name a live process, in ms
+#define PIDFILE_WAIT	1000
+
+// when the wait for the pidfile began
+static struct timespec pf_t0;
+
+int
+reaper_init()
+{
+#ifdef PR_SET_CHILD_SUBREAPER
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+		slog(LOG_ERR, "prctl(PR_SET_CHILD_SUBREAPER) failed: %m");
+		return -1;
+	}
+	return 0;
+#else
+	slog(LOG_ERR, "subreaper mode is not supported on this system");
+	return -1;
+#endif
+}
+
+/*
+ * True if `pid' is a running child of fsv.
+ */
+static int
+is_child(pid_t pid)
+{
+	siginfo_t si;
+
+	if (pid <= 0)
+		return 0;
+	// leave it to be reaped by the main loop if it has exited
+	si.si_pid = 0;
+	if (waitid(P_PID, pid, &si, WEXITED|WNOHANG|WNOWAIT) == -1)
+		return 0;
+	return si.si_pid == 0;
+}
+
+static pid_t
+from_pidfile(const char *path)
+{
+	long pid = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld", &pid) != 1)
+		pid = 0;
+	fclose(f);
+	return pid;
+}
+
+/*
+ * The only child of fsv that isn't one of the `nskip' in `skip',
+ * or 0 if there isn't exactly one.
+ */
+static pid_t
+only_child(pid_t skip[], int nskip)
+{
+	pid_t found = 0;
+	DIR *d;
+	struct dirent *de;
+
+	// children are listed under the thread that has them
+	d = opendir("/proc/self/task");
+	if (d == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		char path[32 + sizeof(de->d_name)];
+		long pid;
+		FILE *f;
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/task/%s/children",
+		    de->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		while (fscanf(f, "%ld", &pid) == 1) {
+			int skipped = 0;
+			for (int i=0; i<nskip; i++)
+				if (pid == skip[i])
+					skipped = 1;
+			if (skipped)
+				continue;
+			if (found != 0) {
+				found = -1;
+				break;
+			}
+			found = pid;
+		}
+		fclose(f);
+	}
+	closedir(d);
+
+	return found > 0 ? found : 0;
+}
+
+/*
+ * cmd, or the process being followed, exited with `status'.
+ * Returns the process to follow from now on, 0 if the service is gone,
+ * or -1 if the pidfile may yet name one; then call reaper_recheck()
+ * every REAPER_POLL_MS until it says.
+ *
+ * With a pidfile, follow whichever child it names.
+ * Without, follow the only child fsv didn't start itself (other than
+ * those in `skip'), but only after a clean exit: a daemon's parent
+ * exits 0 once it has forked, while a crash that leaves helpers behind
+ * is still a crash.
+ */
+pid_t
+reaper_follow(const char *pidfile, int status, pid_t skip[], int nskip)
+{
+	pid_t pid;
+	int clean = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	if (pidfile != NULL) {
+		pid = from_pidfile(pidfile);
+		if (is_child(pid))
+			return pid;
+		// The daemon may write it only after its parent has exited.
+		// After a crash, it is either there already or not at all.
+		if (clean) {
+			clock_gettime(CLOCK_MONOTONIC, &pf_t0);
+			return -1;
+		}
+		slog(LOG_DEBUG, "pidfile names no live child");
+		return 0;
+	}
+
+	if (!clean)
+		return 0;
+	pid = only_child(skip, nskip);
+	return is_child(pid) ? pid : 0;
+}
+
+/*
+ * Look at the pidfile again, after reaper_follow() returned -1.
+ * Returns the process to follow, 0 to look again later, or -1 once
+ * PIDFILE_WAIT is up and the service is gone.
+ */
+pid_t
+reaper_recheck(const char *pidfile)
+{
+	struct timespec now;
+	pid_t pid;
+
+	pid = from_pidfile(pidfile);
+	if (is_child(pid))
+		return pid;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - pf_t0.tv_sec) * 1000 +
+	    (now.tv_nsec - pf_t0.tv_nsec) / 1000000 < PIDFILE_WAIT)
+		return 0;
+	slog(LOG_DEBUG, "pidfile names no live child");
+	return -1;
+}
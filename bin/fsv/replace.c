@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <fsvstat.h>
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Replacing cmd without downtime, for --replace.
+ *
+ * This only asks the fsv of the service to do it, with SIGREPLACE, and
+ * waits for the outcome in info.struct. fsv starts a second cmd next to
+ * the running one, on the same log pipe; once that is up, the old one is
+ * sent SIGTERM. If the new one dies or doesn't come up in time instead,
+ * the old one is kept.
+ */
+
+// how long fsv gets to take up the request, in ms
+#define REP_ACK_WAIT	1000
+// how often to look at info.struct, in ms
+#define REP_POLL_MS	10
+
+
+/*
+ * Replace cmd of the service `name' of user `u', and wait until done.
+ * This function does not return, and instead calls exit(3).
+ */
+void
+replace_cmd(uid_t u, char *name)
+{
+	struct allinfo ai;
+	struct timespec t0, now;
+	long replaces, aborts;
+	pid_t fsv_pid, old_pid;
+	fsvstat *h;
+	int acked = 0;
+
+	h = fsvstat_open(u, name);
+	if (h == NULL) {
+		slog(LOG_ERR, "open(info.struct) failed: %m");
+		exit(1);
+	}
+	if (fsvstat_raw(h, &ai, sizeof(ai)) == -1) {
+		if (errno == EPROTO)
+			slog(LOG_ERR, "unexpected data in info.struct");
+		else
+			slog(LOG_ERR, "read from info.struct failed: %m");
+		exit(1);
+	}
+
+	if (ai.fsv.pid <= 0 || !status_running(u, name)) {
+		slog(LOG_ERR, "%s is not running", name);
+		exit(1);
+	}
+	if (ai.chld[0].pid <= 0 && ai.fsv.rep_state == REP_NONE) {
+		slog(LOG_ERR, "cmd of %s is not running", name);
+		exit(1);
+	}
+
+	fsv_pid = ai.fsv.pid;
+	old_pid = ai.fsv.rep_state == REP_NONE ? ai.chld[0].pid :
+	    ai.fsv.rep_old;
+	replaces = ai.fsv.replaces;
+	aborts = ai.fsv.rep_aborts;
+	// one that is under way is waited for rather than asked for again
+	if (ai.fsv.rep_state == REP_NONE && kill(fsv_pid, SIGREPLACE) == -1) {
+		slog(LOG_ERR, "kill(%ld) failed: %m", (long)fsv_pid);
+		exit(1);
+	}
+
+	/*
+	 * fsv takes as long as it needs, bounded by --up-secs and
+	 * --deadline on its side.
+	 */
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (1) {
+		struct timespec ts = { 0, REP_POLL_MS * 1000000 };
+		nanosleep(&ts, NULL);
+
+		if (!status_running(u, name)) {
+			slog(LOG_ERR, "fsv of %s went away", name);
+			exit(1);
+		}
+		if (fsvstat_raw(h, &ai, sizeof(ai)) == -1)
+			continue;
+		if (ai.fsv.rep_state != REP_NONE)
+			acked = 1;
+		if (ai.fsv.rep_state == REP_NONE &&
+		    (ai.fsv.replaces != replaces || ai.fsv.rep_aborts != aborts))
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!acked && (now.tv_sec - t0.tv_sec) * 1000 +
+		    (now.tv_nsec - t0.tv_nsec) / 1000000 > REP_ACK_WAIT) {
+			slog(LOG_ERR, "fsv of %s did not start a replace; "
+			    "see its log", name);
+			exit(1);
+		}
+	}
+	fsvstat_close(h);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ai.fsv.replaces != replaces) {
+		printf("%s: replaced %ld with %ld in %.3f secs\n", name,
+		    (long)old_pid, (long)ai.chld[0].pid,
+		    (now.tv_sec - t0.tv_sec) +
+		    (now.tv_nsec - t0.tv_nsec) / 1e9);
+		exit(0);
+	}
+	// the old one may already have been told to stop, and then
+	// cmd is restarted
+	if (ai.chld[0].pid == old_pid)
+		printf("%s: replacement failed, still running %ld\n", name,
+		    (long)old_pid);
+	else
+		printf("%s: replacement failed, cmd restarted\n", name);
+	exit(1);
+}
@@ -0,0 +1,216 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Live CPU and memory use of cmd, for --sample.
+ *
+ * Every so often, the CPU time cmd used so far and the memory it has now
+ * are read, and the CPU use since the last sample worked out from them.
+ * That is one read of /proc/PID/stat for cmd alone; with --sample-tree,
+ * either two reads of cmd's cgroup, with --cgroup, or one per process
+ * found through /proc/PID/task/TID/children otherwise.
+ *
+ * A descendant that exits takes its CPU time with it, until it is waited
+ * for, so a sample that would go negative counts as 0.
+ */
+
+// how far down the tree of processes to look, and how many to count
+#define SMP_DEPTH	16
+#define SMP_PROCS	1024
+
+// seconds the moving averages reach back, roughly
+#define SMP_AVG_SECS	60.0
+
+static long clk_tck;
+static long page_size;
+// weight of a new sample in the moving averages
+static double alpha;
+// when the last sample was taken, running or not
+static struct timespec last;
+
+/*
+ * Get ready to sample every u->interval seconds.
+ * `cgroup' is true if cmd has a cgroup to read from.
+ */
+void
+smp_init(struct fsv_usage *u, int cgroup)
+{
+	clk_tck = sysconf(_SC_CLK_TCK);
+	page_size = sysconf(_SC_PAGESIZE);
+	alpha = 1 - exp(-u->interval / SMP_AVG_SECS);
+	if (u->tree && !cgroup)
+		slog(LOG_DEBUG, "no cgroup, looking for descendants in /proc");
+}
+
+/*
+ * Add the CPU time, in ticks, and resident memory, in pages, of `pid'.
+ * Returns -1 if it is gone.
+ */
+static int
+proc_read(pid_t pid, long long *ticks, long long *pages)
+{
+	char path[64];
+	char buf[1024];
+	unsigned long long utime, stime;
+	long long rss;
+	ssize_t r;
+	char *c;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+
+	// the command name may hold anything, so skip past its last ')';
+	// then come state, and fields 4 to 24, of which we want 14, 15, 24
+	c = strrchr(buf, ')');
+	if (c == NULL || sscanf(c + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+	    "%*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %lld",
+	    &utime, &stime, &rss) != 3)
+		return -1;
+	*ticks += utime + stime;
+	*pages += rss;
+	return 0;
+}
+
+/*
+ * Add `pid' and its descendants.
+ */
+static void
+tree_read(pid_t pid, long long *ticks, long long *pages, int *n, int depth)
+{
+	char path[64];
+	DIR *d;
+	struct dirent *de;
+
+	if (*n >= SMP_PROCS || proc_read(pid, ticks, pages) == -1)
+		return;
+	(*n)++;
+	if (depth >= SMP_DEPTH)
+		return;
+
+	// children are listed per thread that forked them
+	snprintf(path, sizeof(path), "/proc/%ld/task", (long)pid);
+	d = opendir(path);
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		char cpath[sizeof(path) + sizeof(de->d_name) + 16];
+		char buf[4096];
+		ssize_t r;
+		char *c, *end;
+		int fd;
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(cpath, sizeof(cpath), "%s/%s/children", path,
+		    de->d_name);
+		fd = open(cpath, O_RDONLY|O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		r = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (r <= 0)
+			continue;
+		buf[r] = '\0';
+		for (c = buf; ; c = end) {
+			long child = strtol(c, &end, 10);
+			if (end == c)
+				break;
+			tree_read(child, ticks, pages, n, depth + 1);
+		}
+	}
+	closedir(d);
+}
+
+/*
+ * Take a sample of cmd, `pid', if it is time to.
+ * Returns true if `u' was updated.
+ */
+int
+smp_tick(struct fsv_usage *u, pid_t pid)
+{
+	struct timespec now;
+	long long cpu_ns, mem, ms;
+	int n = 0;
+
+	if (u->interval == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// allow for a late timer
+	ms = (now.tv_sec - last.tv_sec) * 1000 +
+	    (now.tv_nsec - last.tv_nsec) / 1000000;
+	if (ms < u->interval * 1000 - 50)
+		return 0;
+	last = now;
+
+	if (pid <= 0) {
+		if (u->pid == 0)
+			return 0;
+		u->pid = 0;
+		u->cpu = 0;
+		u->mem_kib = 0;
+		u->nprocs = 0;
+		return 1;
+	}
+
+	if (u->tree && cg_usage(&cpu_ns, &mem) == 0) {
+		n = -1;
+	} else {
+		long long ticks = 0, pages = 0;
+
+		if (u->tree)
+			tree_read(pid, &ticks, &pages, &n, 0);
+		else if (proc_read(pid, &ticks, &pages) == 0)
+			n = 1;
+		if (n == 0)
+			return 0;
+		cpu_ns = ticks * (1000000000LL / clk_tck);
+		mem = pages * page_size;
+	}
+
+	// the first sample of a process is only a starting point
+	if (u->pid == pid) {
+		long long dt = (now.tv_sec - u->at.tv_sec) * 1000000000LL +
+		    (now.tv_nsec - u->at.tv_nsec);
+		long long dcpu = cpu_ns - u->cpu_ns;
+
+		u->cpu = dcpu > 0 && dt > 0 ? 100.0 * dcpu / dt : 0;
+		// there is no CPU figure before the second sample
+		u->cpu_avg = u->samples > 1 ? u->cpu_avg + alpha *
+		    (u->cpu - u->cpu_avg) : u->cpu;
+		if (u->cpu > u->cpu_peak)
+			u->cpu_peak = u->cpu;
+	}
+	if (mem >= 0) {
+		u->mem_kib = mem / 1024;
+		u->mem_avg_kib = u->samples ? u->mem_avg_kib + alpha *
+		    (u->mem_kib - u->mem_avg_kib) : u->mem_kib;
+		if (u->mem_kib > u->mem_peak_kib)
+			u->mem_peak_kib = u->mem_kib;
+	}
+	u->nprocs = n;
+	u->samples++;
+
+	u->pid = pid;
+	u->cpu_ns = cpu_ns;
+	u->at = now;
+	return 1;
+}
@@ -0,0 +1,693 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * The sink is a thread that sits between cmd and log when fsv itself needs
+ * to look at the output, e.g. to keep the log store.
+ *
+ * cmd writes into a pipe that only the sink reads.
+ * The sink splits the data into lines, hands each one to the enabled
+ * features, and relays the bytes unchanged to the log process, if any.
+ *
+ * Before that, lines may be filtered to survive log storms:
+ * runs of identical lines are collapsed into a single
+ * "last message repeated N times", and a token bucket limits
+ * the lines and bytes per second.
+ * Filtered lines are counted exactly in info.struct.
+ *
+ * The thread inherits the blocked signal mask from main(), so all
+ * signals are still handled by the main loop.
+ */
+
+static struct sinkconf *sc;
+
+// statistics, shared with write_info(); protected by info_mtx
+struct fsv_sink sinkinfo;
+// the thread's own copy, published at most once a second
+static struct fsv_sink stats;
+static struct timespec last_sync;
+
+// cmd output comes in here
+static int sink_in = -1;
+// and goes out to log here, -1 if there is no log process
+static int sink_out = -1;
+// the other end of that, to take back what log didn't read before exit
+static int sink_reclaim = -1;
+// set by sink_stop() if log is gone, so that nothing else reads from it
+static int reclaim_ok = 0;
+
+// main() writes here to ask the thread to finish up
+static int wakepipe[2] = { -1, -1 };
+
+static pthread_t sink_tid;
+
+// the partial line currently being assembled
+static char line[SINK_LINE_MAX];
+static size_t linelen = 0;
+
+// set when something arrived since the last idle flush, and when
+static int dirty = 0;
+static struct timespec last_in;
+
+// output waiting to be relayed to log
+static char obuf[65536];
+static size_t olen = 0;
+
+// the backlog: the ring holds the oldest data,
+// the spill file anything after that
+static char *ring = NULL;
+static size_t ring_size;
+static size_t ring_head = 0;
+static size_t ring_len = 0;
+static int spill_fd = -1;
+static off_t spill_rd = 0;
+static off_t spill_wr = 0;
+
+// previous line, for collapsing repeats
+static char prev[SINK_LINE_MAX];
+static size_t prevlen = 0;
+static int prevnl = 0;
+static int have_prev = 0;
+static long long repeats = 0;
+
+// token buckets, refilled up to one second's worth
+static double tok_lines;
+static double tok_bytes;
+static struct timespec tok_last;
+// lines dropped since the last notice
+static long long dropped = 0;
+
+static void sink_emit(const struct timespec *, const char *, size_t, int);
+static void sink_feed(const struct timespec *, const char *, size_t);
+static void sink_line(const struct timespec *, const char *, size_t, int);
+static void sink_notices(const struct timespec *);
+static int sink_ratelimit(size_t);
+static void sink_sync(const struct timespec *, int);
+static void sink_relay(const char *, size_t);
+static void sink_relay_flush();
+static void backlog_push(const char *, size_t);
+static void backlog_drain();
+static void backlog_save();
+static void *sink_main(void *);
+
+int
+sink_start(struct sinkconf *conf, int in, int out, int reclaim)
+{
+	sc = conf;
+	sink_in = in;
+	sink_out = out;
+	sink_reclaim = reclaim;
+
+	stats.enabled = 1;
+	stats.rate_lines = sc->rate_lines;
+	stats.rate_bytes = sc->rate_bytes;
+	stats.collapse = sc->collapse;
+	pthread_mutex_lock(&info_mtx);
+	sinkinfo = stats;
+	pthread_mutex_unlock(&info_mtx);
+
+	tok_lines = sc->rate_lines;
+	tok_bytes = sc->rate_bytes;
+	clock_gettime(CLOCK_MONOTONIC, &tok_last);
+
+	if (sink_out != -1) {
+		fcntl(sink_out, F_SETFL, fcntl(sink_out, F_GETFL) | O_NONBLOCK);
+
+		ring_size = sc->log_buffer_kib * 1024;
+		ring = malloc(ring_size);
+		if (ring == NULL) {
+			slog(LOG_ERR, "malloc() failed: %m");
+			return -1;
+		}
+
+		// pick up what a previous fsv couldn't deliver
+		spill_fd = open("spill", O_CREAT|O_RDWR|O_CLOEXEC, 00600);
+		if (spill_fd == -1) {
+			slog(LOG_ERR, "open(spill) failed: %m");
+			return -1;
+		}
+		spill_wr = lseek(spill_fd, 0, SEEK_END);
+		if (spill_wr > 0)
+			slog(LOG_INFO, "replaying %lld bytes of spilled output",
+			    (long long)spill_wr);
+		stats.backlog = spill_wr;
+	}
+
+	if (sc->store) {
+		if (store_open(sc->store_kib, sc->store_keep,
+		    sc->store_compress) == -1)
+			return -1;
+	}
+
+	if (sc->tail_kib > 0) {
+		if (tail_open(sc->tail_kib) == -1)
+			return -1;
+	}
+
+	if (sc->fwd_path != NULL) {
+		if (fwd_open(sc->fwd_path, sc->fwd_name, sc->fwd_kib) == -1)
+			return -1;
+	}
+
+	if (pipe(wakepipe) == -1) {
+		slog(LOG_ERR, "pipe() failed: %m");
+		return -1;
+	}
+	fcntl(wakepipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(wakepipe[1], F_SETFD, FD_CLOEXEC);
+
+	int e = pthread_create(&sink_tid, NULL, sink_main, NULL);
+	if (e != 0) {
+		errno = e;
+		slog(LOG_ERR, "pthread_create() failed: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drain whatever is left in the pipe, flush everything, and stop the thread.
+ * If `log_gone', also take back what is still in the pipe to log.
+ */
+void
+sink_stop(int log_gone)
+{
+	if (wakepipe[1] == -1)
+		return;
+
+	reclaim_ok = log_gone;
+	write(wakepipe[1], "", 1);
+	pthread_join(sink_tid, NULL);
+
+	close(wakepipe[0]);
+	close(wakepipe[1]);
+	wakepipe[0] = wakepipe[1] = -1;
+}
+
+static void *
+sink_main(void *arg)
+{
+	struct pollfd pfd[4];
+	char buf[65536];
+	struct timespec ts;
+	ssize_t r;
+
+	// writes to a dead log pipe should fail, not kill fsv
+	sigset_t pipemask;
+	sigemptyset(&pipemask);
+	sigaddset(&pipemask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipemask, NULL);
+
+	pfd[0].fd = sink_in;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wakepipe[0];
+	pfd[1].events = POLLIN;
+	pfd[2].events = POLLOUT;
+	pfd[3].revents = 0;
+
+	if (sink_out != -1)
+		backlog_drain();
+
+	while (1) {
+		// wake up after a second of quiet to flush partial lines
+		int tmout = dirty ? 1000 : -1;
+
+		// only wait on log if there is a backlog for it;
+		// poll(2) ignores negative fds
+		pfd[2].fd = (ring_len > 0 || spill_rd < spill_wr) ? sink_out : -1;
+
+		// the forwarder may have to send or connect before then
+		if (sc->fwd_path != NULL) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			tmout = fwd_timeout(&ts, tmout);
+			pfd[3].fd = fwd_pollfd(&pfd[3].events);
+		} else
+			pfd[3].fd = -1;
+
+		r = poll(pfd, 4, tmout);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			slog(LOG_ERR, "sink: poll() failed: %m");
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		if (sc->fwd_path != NULL &&
+		    fwd_run(&ts, pfd[3].revents & (POLLOUT|POLLERR|POLLHUP)))
+			sink_sync(&ts, 1);
+
+		if (r == 0) {
+			// it is only idle after a second without input
+			if (!dirty || (ts.tv_sec - last_in.tv_sec) * 1000 +
+			    (ts.tv_nsec - last_in.tv_nsec) / 1000000 < 1000)
+				continue;
+			dirty = 0;
+			if (linelen > 0) {
+				sink_line(&ts, line, linelen, 0);
+				linelen = 0;
+			}
+			sink_notices(&ts);
+			sink_relay_flush();
+			if (sc->store)
+				store_flush();
+			sink_sync(&ts, 1);
+			continue;
+		}
+
+		if (pfd[2].revents & (POLLOUT|POLLERR)) {
+			backlog_drain();
+			// make sure status shows when it is all caught up
+			sink_sync(&ts, ring_len == 0 && spill_rd == spill_wr);
+		}
+
+		if (pfd[0].revents & (POLLIN|POLLHUP)) {
+			r = read(sink_in, buf, sizeof(buf));
+			if (r > 0) {
+				sink_feed(&ts, buf, r);
+				dirty = 1;
+				last_in = ts;
+				sink_sync(&ts, 0);
+			}
+		}
+
+		if (pfd[1].revents & POLLIN)
+			break;
+	}
+
+	// drain what is left without blocking
+	fcntl(sink_in, F_SETFL, fcntl(sink_in, F_GETFL) | O_NONBLOCK);
+	while ((r = read(sink_in, buf, sizeof(buf))) > 0)
+		sink_feed(&ts, buf, r);
+	if (linelen > 0) {
+		sink_line(&ts, line, linelen, 0);
+		linelen = 0;
+	}
+	sink_notices(&ts);
+	sink_relay_flush();
+	backlog_save();
+
+	if (sc->store)
+		store_close();
+	if (sc->fwd_path != NULL)
+		fwd_close();
+	sink_sync(&ts, 1);
+
+	return NULL;
+}
+
+/*
+ * Split a chunk of output into lines.
+ * Lines longer than SINK_LINE_MAX are split up.
+ */
+static void
+sink_feed(const struct timespec *ts, const char *buf, size_t len)
+{
+	while (len > 0) {
+		const char *nl = memchr(buf, '\n', len);
+		size_t n = (nl != NULL) ? (size_t)(nl - buf) : len;
+		int complete = (nl != NULL);
+
+		if (n > sizeof(line) - linelen) {
+			n = sizeof(line) - linelen;
+			complete = 0;
+		}
+
+		memcpy(line + linelen, buf, n);
+		linelen += n;
+		buf += n;
+		len -= n;
+
+		if (complete) {
+			// skip the newline itself
+			buf++;
+			len--;
+		}
+
+		if (complete || linelen == sizeof(line)) {
+			sink_line(ts, line, linelen, complete);
+			linelen = 0;
+		}
+	}
+
+	sink_relay_flush();
+}
+
+/*
+ * Handle one line, without its newline.
+ * Arg 'nl': whether it was terminated by a newline.
+ */
+static void
+sink_line(const struct timespec *ts, const char *s, size_t len, int nl)
+{
+	stats.lines++;
+
+	if (sc->collapse) {
+		if (have_prev && len == prevlen && nl == prevnl &&
+		    memcmp(s, prev, len) == 0) {
+			stats.suppressed++;
+			repeats++;
+			return;
+		}
+		memcpy(prev, s, len);
+		prevlen = len;
+		prevnl = nl;
+		have_prev = 1;
+	}
+
+	sink_notices(ts);
+
+	if (!sink_ratelimit(len + nl)) {
+		stats.dropped++;
+		dropped++;
+		return;
+	}
+
+	sink_emit(ts, s, len, nl);
+}
+
+/*
+ * Emit pending "repeated" and "dropped" notices.
+ * These are not subject to the rate limit.
+ */
+static void
+sink_notices(const struct timespec *ts)
+{
+	char msg[96];
+	int n;
+
+	if (repeats > 0) {
+		n = snprintf(msg, sizeof(msg),
+		    "fsv: last message repeated %lld times", repeats);
+		repeats = 0;
+		sink_emit(ts, msg, n, 1);
+	}
+	if (dropped > 0 && sink_ratelimit(0)) {
+		n = snprintf(msg, sizeof(msg),
+		    "fsv: rate limit dropped %lld lines", dropped);
+		dropped = 0;
+		sink_emit(ts, msg, n, 1);
+	}
+}
+
+/*
+ * Take tokens for one line of `len' bytes.
+ * Returns 1 if the line may pass, 0 if it should be dropped.
+ * With len 0, only checks whether a line could pass right now.
+ */
+static int
+sink_ratelimit(size_t len)
+{
+	struct timespec now;
+	double el;
+
+	if (sc->rate_lines == 0 && sc->rate_bytes == 0)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	el = (now.tv_sec - tok_last.tv_sec) +
+	    (now.tv_nsec - tok_last.tv_nsec) / 1e9;
+	tok_last = now;
+
+	tok_lines += el * sc->rate_lines;
+	if (tok_lines > sc->rate_lines)
+		tok_lines = sc->rate_lines;
+	tok_bytes += el * sc->rate_bytes;
+	if (tok_bytes > sc->rate_bytes)
+		tok_bytes = sc->rate_bytes;
+
+	if (sc->rate_lines != 0 && tok_lines < 1)
+		return 0;
+	// a line longer than the whole bucket still passes once it's full,
+	// and the debt holds off the lines after it
+	if (sc->rate_bytes != 0 && tok_bytes < len && tok_bytes < sc->rate_bytes)
+		return 0;
+	if (len == 0)
+		return 1;
+
+	tok_lines -= 1;
+	tok_bytes -= len;
+	return 1;
+}
+
+/*
+ * Publish the counters to info.struct, if a second has passed or `force'.
+ */
+static void
+sink_sync(const struct timespec *ts, int force)
+{
+	if (!force && ts->tv_sec == last_sync.tv_sec)
+		return;
+	last_sync = *ts;
+
+	if (sc->fwd_path != NULL)
+		fwd_stats(&stats.fwd);
+
+	pthread_mutex_lock(&info_mtx);
+	sinkinfo = stats;
+	pthread_mutex_unlock(&info_mtx);
+	sync_info();
+}
+
+/*
+ * Pass a line on to the store and log.
+ */
+static void
+sink_emit(const struct timespec *ts, const char *s, size_t len, int nl)
+{
+	if (sc->store)
+		store_append(ts, s, len);
+	if (sc->tail_kib > 0) {
+		tail_append(s, len);
+		if (nl)
+			tail_append("\n", 1);
+	}
+	if (sc->fwd_path != NULL)
+		fwd_append(ts, s, len);
+
+	sink_relay(s, len);
+	if (nl)
+		sink_relay("\n", 1);
+}
+
+static void
+sink_relay(const char *s, size_t len)
+{
+	if (sink_out == -1)
+		return;
+
+	while (len > 0) {
+		if (olen == sizeof(obuf))
+			sink_relay_flush();
+
+		size_t n = sizeof(obuf) - olen;
+		if (n > len)
+			n = len;
+		memcpy(obuf + olen, s, n);
+		olen += n;
+		s += n;
+		len -= n;
+	}
+}
+
+/*
+ * Write out obuf, or as much as log takes right now;
+ * the rest goes into the backlog.
+ */
+static void
+sink_relay_flush()
+{
+	size_t off = 0;
+
+	// keep the order: nothing jumps ahead of the backlog
+	if (ring_len > 0)
+		backlog_drain();
+
+	while (ring_len == 0 && off < olen) {
+		ssize_t w = write(sink_out, obuf + off, olen - off);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				slog(LOG_WARNING,
+				    "sink: write to log pipe failed: %m");
+			break;
+		}
+		off += w;
+	}
+
+	if (off < olen)
+		backlog_push(obuf + off, olen - off);
+	olen = 0;
+}
+
+/*
+ * Backlog.
+ * The ring is refilled from the spill file as it empties.
+ */
+
+static void
+backlog_push(const char *s, size_t len)
+{
+	stats.backlog += len;
+
+	// once spilling, everything goes to the spill file to keep the order
+	if (spill_wr == spill_rd) {
+		while (len > 0 && ring_len < ring_size) {
+			size_t tail = (ring_head + ring_len) % ring_size;
+			size_t n = (tail >= ring_head) ?
+			    ring_size - tail : ring_head - tail;
+			if (n > len)
+				n = len;
+			memcpy(ring + tail, s, n);
+			ring_len += n;
+			s += n;
+			len -= n;
+		}
+	}
+
+	if (len == 0)
+		return;
+
+	ssize_t w = pwrite(spill_fd, s, len, spill_wr);
+	if (w != len) {
+		slog(LOG_ERR, "sink: write to spill file failed, "
+		    "%zu bytes lost: %m", len);
+		stats.backlog -= len;
+		return;
+	}
+	if (spill_wr == 0)
+		slog(LOG_WARNING, "log is not keeping up, spilling to disk");
+	spill_wr += len;
+	stats.spilled += len;
+}
+
+static void
+backlog_drain()
+{
+	while (1) {
+		// refill the ring from the spill file
+		if (ring_len == 0 && spill_rd < spill_wr) {
+			ssize_t r = pread(spill_fd, ring, ring_size, spill_rd);
+			if (r <= 0) {
+				slog(LOG_ERR, "sink: read from spill file failed, "
+				    "%lld bytes lost: %m",
+				    (long long)(spill_wr - spill_rd));
+				stats.backlog -= spill_wr - spill_rd;
+				spill_rd = spill_wr;
+			} else {
+				ring_head = 0;
+				ring_len = r;
+				spill_rd += r;
+			}
+			if (spill_rd == spill_wr) {
+				ftruncate(spill_fd, 0);
+				spill_rd = spill_wr = 0;
+			}
+		}
+		if (ring_len == 0)
+			return;
+
+		size_t n = ring_size - ring_head;
+		if (n > ring_len)
+			n = ring_len;
+
+		ssize_t w = write(sink_out, ring + ring_head, n);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				slog(LOG_WARNING,
+				    "sink: write to log pipe failed: %m");
+			return;
+		}
+
+		ring_head = (ring_head + w) % ring_size;
+		ring_len -= w;
+		stats.backlog -= w;
+	}
+}
+
+/*
+ * On exit, leave the whole backlog in the spill file, oldest first,
+ * for the next fsv to replay.
+ */
+static void
+backlog_save()
+{
+	int fd;
+	off_t off;
+
+	if (spill_fd == -1)
+		return;
+
+	fd = open("spill.new", O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 00600);
+	if (fd == -1) {
+		slog(LOG_ERR, "open(spill.new) failed: %m");
+		return;
+	}
+
+	// log is gone, so what is still in the pipe would be lost
+	// along with it; it is older than anything in the backlog.
+	// If it is still there, it may yet read it, and the two of
+	// us must not split it between them.
+	struct pollfd pfd = { sink_reclaim, POLLIN, 0 };
+	while (reclaim_ok && poll(&pfd, 1, 0) == 1 &&
+	    (pfd.revents & POLLIN)) {
+		ssize_t r = read(sink_reclaim, obuf, sizeof(obuf));
+		if (r <= 0)
+			break;
+		if (write(fd, obuf, r) != r)
+			goto fail;
+		stats.backlog += r;
+	}
+
+	while (ring_len > 0) {
+		size_t n = ring_size - ring_head;
+		if (n > ring_len)
+			n = ring_len;
+		if (write(fd, ring + ring_head, n) != n)
+			goto fail;
+		ring_head = (ring_head + n) % ring_size;
+		ring_len -= n;
+	}
+
+	// obuf is free by now
+	for (off = spill_rd; off < spill_wr; ) {
+		ssize_t r = pread(spill_fd, obuf, sizeof(obuf), off);
+		if (r <= 0 || write(fd, obuf, r) != r)
+			goto fail;
+		off += r;
+	}
+
+	if (close(fd) == -1 || rename("spill.new", "spill") == -1) {
+		slog(LOG_ERR, "could not save backlog for log: %m");
+		unlink("spill.new");
+		return;
+	}
+
+	if (stats.backlog > 0)
+		slog(LOG_NOTICE, "saved %lld bytes of backlog for log",
+		    (long long)stats.backlog);
+	return;
+
+fail:
+	slog(LOG_ERR, "could not save backlog for log: %m");
+	close(fd);
+	unlink("spill.new");
+}
@@ -1,14 +1,44 @@
+#include <sys/file.h> // for flock(2) on linux
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>	// for LOG_* level constants
 #include <time.h>	// for printing times
 #include <unistd.h>
 
+#include <fsvstat.h>
 #include <slog.h>
 
 #include "extern.h"
 
+static void hist_print(const char *, const struct fsv_hist *);
+
+/*
+ * Whether the service `name' of user `u' is running, i.e. its lock is
+ * held. The pids in info.struct outlive an fsv that was killed, and may
+ * since have been reused.
+ */
+int
+status_running(uid_t u, const char *name)
+{
+	char *path;
+	int fd, r;
+
+	if (asprintf(&path, "%s/fsv-%ld/%s/lock",
+	    FSV_STATE_PREFIX, (long)u, name) == -1)
+		return 0;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return 0;
+	r = flock(fd, LOCK_SH|LOCK_NB) == -1 && errno == EWOULDBLOCK;
+	close(fd);
+	return r;
+}
+
 /*
  * Argument `c' is a character which corresponds to a one-letter flag.
  * Argument `u' is the uid to check status for.
@@ -36,35 +66,25 @@ status(char c, uid_t u, char *name)
 	}
 
 	/*
-	 * Open info.struct.
+	 * Read the data.
 	 */
 
-	int e;
-	int fd_info;
+	struct allinfo ai;
+	fsvstat *h;
 
-	fd_info = open("info.struct", O_RDONLY);
-	if (fd_info == -1) {
+	h = fsvstat_open(u, name);
+	if (h == NULL) {
 		slog(LOG_ERR, "open(info.struct) failed: %m");
 		exit(1);
 	}
-
-	/*
-	 * Read the data.
-	 */
-
-	struct allinfo ai;
-
-	{
-		ssize_t r;
-		r = read(fd_info, &ai, sizeof(ai));
-		if (r == -1) {
-			slog(LOG_ERR, "read from info.struct failed: %m");
-			exit(1);
-		} else if (r < sizeof(ai)) {
+	if (fsvstat_raw(h, &ai, sizeof(ai)) == -1) {
+		if (errno == EPROTO)
 			slog(LOG_ERR, "unexpected data in info.struct");
-			exit(1);
-		}
+		else
+			slog(LOG_ERR, "read from info.struct failed: %m");
+		exit(1);
 	}
+	fsvstat_close(h);
 
 	/*
 	 * Print as needed.
@@ -97,6 +117,23 @@ status(char c, uid_t u, char *name)
 		printf("since (timespec): { %ld, %09ld }\n",
 		       (long)ai.fsv.since.tv_sec, ai.fsv.since.tv_nsec);
 		printf("gaveup: %d\n", ai.fsv.gaveup);
+		if (ai.fsv.admit_rate > 0)
+			printf("admit_queued: %ld\n",
+			    admit_queued("../.admit"));
+		if (ai.fsv.slog_slots > 0) {
+			printf("log_async: %ld\n", ai.fsv.slog_slots);
+			printf("log_async_dropped: %llu\n",
+			    ai.fsv.slog_dropped);
+		}
+		if (ai.fsv.od_state != OD_OFF) {
+			const char *states[] = { "off", "idle", "starting",
+			    "active" };
+			printf("ondemand: %s\n", states[ai.fsv.od_state]);
+			printf("idle_secs: %ld\n", ai.fsv.od_idle);
+			printf("activations: %ld\n", ai.fsv.od_activations);
+			printf("idle_stops: %ld\n", ai.fsv.od_idle_stops);
+			hist_print("activation", &ai.fsv.od_latency);
+		}
 
 		for (int i=0; i<2; i++) {
 			struct fsv_child *p = &ai.chld[i];
@@ -119,6 +156,140 @@ status(char c, uid_t u, char *name)
 			printf("recent_execs: %ld\n", p->recent_execs);
 			printf("max_recent_execs: %ld\n", p->max_recent_execs);
 			printf("recent_secs: %ld\n", p->recent_secs);
+			if (p->last_reason == EXIT_EXEC)
+				printf("last_exit: exec failed, %s\n",
+				    pol_name(p->last_action));
+			else if (p->last_reason == EXIT_CODE)
+				printf("last_exit: code %d, %s\n", p->last_code,
+				    pol_name(p->last_action));
+			else if (p->last_reason == EXIT_SIGNAL)
+				printf("last_exit: signal %d, %s\n", p->last_code,
+				    pol_name(p->last_action));
+			if (p->last_reason != EXIT_NONE)
+				printf("exits: %ld ok, %ld error, %ld signal, "
+				    "%ld exec failed\n", p->exits_ok, p->exits_err,
+				    p->exits_sig, p->exec_fails);
+			if (p->queued)
+				printf("queued: waiting for admission\n");
+			if (p->frozen)
+				printf("frozen: yes\n");
+			if (p->started_as != 0)
+				printf("started_as: %ld\n", (long)p->started_as);
+			if (p->ready_fd != 0 && p->pid > 0)
+				printf("ready: %s\n", p->ready ? "yes" : "no");
+			if (i == 0 && ai.fsv.rep_state != REP_NONE) {
+				const char *steps[] = { "none", "starting",
+				    "stopping", "aborting" };
+				printf("replacing: %s\n",
+				    steps[ai.fsv.rep_state]);
+				printf("old_pid: %ld\n", (long)ai.fsv.rep_old);
+			}
+			if (i == 0 && ai.fsv.replaces + ai.fsv.rep_aborts > 0) {
+				printf("replaces: %ld\n", ai.fsv.replaces);
+				printf("replace_aborts: %ld\n", ai.fsv.rep_aborts);
+				hist_print("replace_overlap", &ai.fsv.rep_overlap);
+			}
+			if (p->exe.path[0] != '\0') {
+				printf("exe: %s\n", p->exe.path);
+				printf("exe_id: dev %lu ino %lu mtime %ld.%09ld\n",
+				    (unsigned long)p->exe.dev,
+				    (unsigned long)p->exe.ino,
+				    (long)p->exe.mtime.tv_sec, p->exe.mtime.tv_nsec);
+				if (p->exe.changed)
+					printf("exe_changed: %s\n", ai.fsv.exe_keep ?
+					    "yes, keeping the old one" :
+					    "yes, will use it at the next start");
+			}
+			if (p->mem.thp_disable)
+				printf("thp: disabled\n");
+			if (p->mem.ksm)
+				printf("ksm: merge\n");
+			if (p->mem.numa[0] != '\0')
+				printf("numa: %s\n", p->mem.numa);
+			if (p->mem.memlock && p->mem.memlock_kib == -1)
+				printf("memlock: unlimited\n");
+			else if (p->mem.memlock)
+				printf("memlock: %lld KiB\n", p->mem.memlock_kib);
+
+			if (p->usage.interval > 0) {
+				struct fsv_usage *u = &p->usage;
+
+				printf("sample_secs: %ld%s\n", u->interval,
+				    u->tree ? ", with descendants" : "");
+				printf("cpu: %.1f%% now, %.1f%% avg, %.1f%% peak\n",
+				    u->cpu, u->cpu_avg, u->cpu_peak);
+				printf("mem: %lld KiB now, %.0f KiB avg, "
+				    "%lld KiB peak\n", u->mem_kib,
+				    u->mem_avg_kib, u->mem_peak_kib);
+				if (u->nprocs > 0)
+					printf("procs: %d\n", u->nprocs);
+			}
+
+			hist_print("exit_to_reap", &p->exit_reap);
+			hist_print("reap_to_fork", &p->reap_fork);
+			hist_print("fork_to_exec", &p->fork_exec);
+			hist_print("exec_to_ready", &p->exec_ready);
+			if (p->deferred)
+				printf("deferred: %s\n", p->defer_reason);
+			if (p->deferrals > 0) {
+				printf("deferrals: %ld\n", p->deferrals);
+				printf("last_deferral: %s\n", p->defer_reason);
+			}
+		}
+
+		if (ai.sink.enabled) {
+			struct fsv_sink *sk = &ai.sink;
+
+			printf("\n");
+			printf("sink\n");
+			printf("rate_lines: %ld\n", sk->rate_lines);
+			printf("rate_bytes: %ld\n", sk->rate_bytes);
+			printf("collapse: %d\n", sk->collapse);
+			printf("lines: %lld\n", sk->lines);
+			printf("dropped: %lld\n", sk->dropped);
+			printf("suppressed: %lld\n", sk->suppressed);
+			printf("backlog: %lld\n", sk->backlog);
+			printf("spilled: %lld\n", sk->spilled);
+		}
+
+		if (ai.sink.fwd.enabled) {
+			struct fsv_fwd *fw = &ai.sink.fwd;
+
+			printf("\n");
+			printf("forward\n");
+			printf("path: %s\n", fw->path);
+			if (fw->connected)
+				printf("connected: yes, %s\n",
+				    fw->dgram ? "datagram" : "stream");
+			else
+				printf("connected: no\n");
+			if (fw->last_errno != 0)
+				printf("last_error: %s\n", strerror(fw->last_errno));
+			printf("connects: %lld\n", fw->connects);
+			printf("lines: %lld\n", fw->lines);
+			printf("batches: %lld\n", fw->batches);
+			printf("bytes: %lld\n", fw->bytes);
+			printf("buffered: %lld bytes now, %lld peak, "
+			    "%ld KiB max\n", fw->buffered, fw->buffered_peak,
+			    fw->buffer_kib);
+			printf("stalls: %lld\n", fw->stalls);
+			printf("dropped: %lld\n", fw->dropped);
+		}
+
+		if (ai.store.enabled) {
+			struct fsv_store *st = &ai.store;
+
+			printf("\n");
+			printf("store\n");
+			printf("compress: %d\n", st->compress);
+			printf("compressed_segments: %ld\n", st->z_segs);
+			printf("compressed_bytes: %lld -> %lld\n",
+			    st->z_in, st->z_out);
+			if (st->z_out > 0)
+				printf("compression_ratio: %.2f\n",
+				    (double)st->z_in / st->z_out);
+			printf("compress_cpu: %ld.%06ld secs\n",
+			    (long)st->z_cpu.tv_sec, st->z_cpu.tv_nsec / 1000);
 		}
 	}
 
@@ -127,3 +298,40 @@ status(char c, uid_t u, char *name)
 	else
 		exit(1);
 }
+
+/*
+ * Print a latency histogram, if it has anything in it:
+ * a summary line, then one line per non-empty bucket.
+ */
+static void
+hist_print(const char *what, const struct fsv_hist *h)
+{
+	long long p50 = 0, p99 = 0;
+	long long n = 0;
+
+	if (h->count == 0)
+		return;
+
+	// upper bounds, from the buckets
+	for (int i=0; i<HIST_BUCKETS; i++) {
+		long long hi = (i == HIST_BUCKETS - 1) ? h->max_us : (2LL << i);
+		n += h->bucket[i];
+		if (p50 == 0 && n * 2 >= h->count)
+			p50 = hi;
+		if (p99 == 0 && n * 100 >= h->count * 99)
+			p99 = hi;
+	}
+
+	printf("%s: count %lld, mean %lld us, p50 <= %lld us, p99 <= %lld us, "
+	    "max %lld us\n", what, h->count, h->sum_us / h->count,
+	    p50, p99, h->max_us);
+	for (int i=0; i<HIST_BUCKETS; i++) {
+		if (h->bucket[i] == 0)
+			continue;
+		if (i == HIST_BUCKETS - 1)
+			printf("  %lld- us: %lld\n", 1LL << i, h->bucket[i]);
+		else
+			printf("  %lld-%lld us: %lld\n", i ? 1LL << i : 0,
+			    2LL << i, h->bucket[i]);
+	}
+}
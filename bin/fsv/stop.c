@@ -0,0 +1,318 @@
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <fsvstat.h>
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Bulk shutdown, for --shutdown.
+ *
+ * Every service is asked to stop at once, by sending SIGTERM to its fsv,
+ * which passes it on to cmd and log and exits. Then all of their
+ * processes are waited for together, so the whole thing takes as long as
+ * the slowest service rather than the sum of them. Whatever is still
+ * there at the deadline gets SIGKILL, along with the rest of cmd's cgroup
+ * if it has one.
+ *
+ * None of these processes are our children, so they are waited for with
+ * pidfds where there are any, and by polling with kill(2) otherwise.
+ */
+
+// how long to wait for SIGKILL to take effect, in ms
+#define KILL_WAIT	1000
+// how often to check processes without a pidfd, in ms
+#define POLL_MS		10
+
+struct victim {
+	char *name;
+	// fsv, cmd, and log; 0 for none or once gone
+	pid_t pid[3];
+	int pidfd[3];
+	// cmd's cgroup, or empty
+	char cgdir[512];
+	int killed;
+	// time to stop, once all of pid[] are gone
+	int stopped;
+	struct timespec took;
+};
+
+static long
+ms_since(const struct timespec *t0)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t0->tv_sec) * 1000 +
+	    (now.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+static int
+pidfd_get(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Fill in `v' from the info.struct of `name'.
+ * Returns -1 if it isn't running.
+ */
+static int
+victim_init(struct victim *v, uid_t u, char *name)
+{
+	struct allinfo ai;
+	fsvstat *h;
+	int r;
+
+	memset(v, 0, sizeof(*v));
+	v->name = name;
+	for (int i=0; i<3; i++)
+		v->pidfd[i] = -1;
+
+	h = fsvstat_open(u, name);
+	if (h == NULL)
+		return -1;
+	r = fsvstat_raw(h, &ai, sizeof(ai));
+	fsvstat_close(h);
+	if (r == -1)
+		return -1;
+
+	if (ai.fsv.pid <= 0 || !status_running(u, name))
+		return -1;
+
+	v->pid[0] = ai.fsv.pid;
+	v->pid[1] = ai.chld[0].pid > 0 ? ai.chld[0].pid : 0;
+	v->pid[2] = ai.chld[1].pid > 0 ? ai.chld[1].pid : 0;
+	for (int i=0; i<3; i++)
+		if (v->pid[i] != 0)
+			v->pidfd[i] = pidfd_get(v->pid[i]);
+
+	if (ai.fsv.cgroup && v->pid[1] != 0 &&
+	    cg_path(v->pid[1], v->cgdir, sizeof(v->cgdir)) == -1)
+		v->cgdir[0] = '\0';
+	return 0;
+}
+
+/*
+ * Forget the processes of `v' that are gone.
+ * Returns how many are left.
+ */
+static int
+victim_reap(struct victim *v)
+{
+	int left = 0;
+
+	for (int i=0; i<3; i++) {
+		if (v->pid[i] == 0)
+			continue;
+		if (v->pidfd[i] != -1) {
+			struct pollfd pfd = { v->pidfd[i], POLLIN, 0 };
+			if (poll(&pfd, 1, 0) == 0) {
+				left++;
+				continue;
+			}
+			close(v->pidfd[i]);
+			v->pidfd[i] = -1;
+		} else if (kill(v->pid[i], 0) == 0 || errno != ESRCH) {
+			left++;
+			continue;
+		}
+		v->pid[i] = 0;
+	}
+	return left;
+}
+
+/*
+ * Wait until all of `v' are gone or `ms' have passed since `t0'.
+ * Returns how many services are left.
+ */
+static int
+wait_all(struct victim v[], int n, const struct timespec *t0,
+         const struct timespec *start, long ms)
+{
+	struct pollfd *pfd;
+	int left;
+
+	pfd = calloc(n * 3, sizeof(*pfd));
+	if (pfd == NULL) {
+		slog(LOG_ERR, "calloc() failed: %m");
+		exit(1);
+	}
+
+	while (1) {
+		int npfd = 0, nopidfd = 0;
+		long remain;
+
+		left = 0;
+		for (int i=0; i<n; i++) {
+			if (v[i].stopped)
+				continue;
+			if (victim_reap(&v[i]) == 0) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				v[i].took.tv_sec = now.tv_sec - start->tv_sec;
+				v[i].took.tv_nsec = now.tv_nsec - start->tv_nsec;
+				if (v[i].took.tv_nsec < 0) {
+					v[i].took.tv_sec--;
+					v[i].took.tv_nsec += 1000000000;
+				}
+				v[i].stopped = 1;
+				continue;
+			}
+			left++;
+			for (int j=0; j<3; j++) {
+				if (v[i].pid[j] == 0)
+					continue;
+				if (v[i].pidfd[j] == -1) {
+					nopidfd = 1;
+					continue;
+				}
+				pfd[npfd].fd = v[i].pidfd[j];
+				pfd[npfd].events = POLLIN;
+				npfd++;
+			}
+		}
+
+		remain = ms - ms_since(t0);
+		if (left == 0 || remain <= 0)
+			break;
+		if (nopidfd && remain > POLL_MS)
+			remain = POLL_MS;
+		if (poll(pfd, npfd, remain) == -1 && errno != EINTR) {
+			slog(LOG_ERR, "poll() failed: %m");
+			exit(1);
+		}
+	}
+
+	free(pfd);
+	return left;
+}
+
+/*
+ * Stop the services in `names' of user `u', or all of them if `n' is 0,
+ * giving them `deadline' seconds before killing them.
+ * Prints how long each took.
+ * This function does not return, and instead calls exit(3).
+ */
+void
+stop_all(uid_t u, char *names[], int n, long deadline)
+{
+	struct victim *v;
+	int nv = 0;
+	int left;
+	struct timespec start;
+	char **all = NULL;
+
+	if (n == 0) {
+		char *dir;
+		DIR *d;
+		struct dirent *de;
+		int cap = 0;
+
+		if (asprintf(&dir, "%s/fsv-%ld", FSV_STATE_PREFIX, (long)u)
+		    == -1) {
+			slog(LOG_ERR, "asprintf: %m");
+			exit(1);
+		}
+		d = opendir(dir);
+		if (d == NULL) {
+			slog(LOG_ERR, "opendir(%s) failed: %m", dir);
+			exit(1);
+		}
+		free(dir);
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (n == cap) {
+				cap = cap ? cap * 2 : 64;
+				all = realloc(all, cap * sizeof(*all));
+				if (all == NULL) {
+					slog(LOG_ERR, "realloc() failed: %m");
+					exit(1);
+				}
+			}
+			all[n++] = strdup(de->d_name);
+		}
+		closedir(d);
+		names = all;
+	}
+
+	v = calloc(n ? n : 1, sizeof(*v));
+	if (v == NULL) {
+		slog(LOG_ERR, "calloc() failed: %m");
+		exit(1);
+	}
+	for (int i=0; i<n; i++) {
+		if (victim_init(&v[nv], u, names[i]) == 0)
+			nv++;
+		else if (all == NULL)
+			printf("%s: not running\n", names[i]);
+	}
+
+	/*
+	 * Ask them all to stop, then wait for them together.
+	 */
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<nv; i++) {
+		kill(v[i].pid[0], SIGTERM);
+		// in case it was stopped
+		kill(v[i].pid[0], SIGCONT);
+	}
+
+	left = wait_all(v, nv, &start, &start, deadline * 1000);
+
+	if (left > 0) {
+		struct timespec t0;
+
+		for (int i=0; i<nv; i++) {
+			if (v[i].stopped)
+				continue;
+			slog(LOG_WARNING, "%s did not stop in %ld secs, killing",
+			    v[i].name, deadline);
+			if (v[i].cgdir[0] != '\0')
+				cg_kill(v[i].cgdir);
+			for (int j=0; j<3; j++)
+				if (v[i].pid[j] != 0)
+					kill(v[i].pid[j], SIGKILL);
+			v[i].killed = 1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		left = wait_all(v, nv, &t0, &start, KILL_WAIT);
+	}
+
+	/*
+	 * Report.
+	 */
+
+	for (int i=0; i<nv; i++) {
+		if (!v[i].stopped)
+			printf("%s: still running\n", v[i].name);
+		else
+			printf("%s: %s %ld.%03ld secs\n", v[i].name,
+			    v[i].killed ? "killed after" : "stopped in",
+			    (long)v[i].took.tv_sec,
+			    v[i].took.tv_nsec / 1000000);
+	}
+	printf("total: %.3f secs\n", ms_since(&start) / 1000.0);
+
+	exit(left > 0 ? 1 : 0);
+}
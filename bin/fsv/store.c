@@ -0,0 +1,952 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * The log store keeps cmd output as an append-only series of segment files
+ * under store/ in the state directory.
+ *
+ * Each segment NNNNNNNN.seg is a sequence of records: a struct store_rec
+ * header followed by `len' bytes of data (one line, without the newline).
+ * Alongside it, NNNNNNNN.idx holds a sparse index: one struct store_idx for
+ * the first record of the segment, then one for the first record starting
+ * at least STORE_IDX_BYTES after the previous entry.
+ *
+ * Timestamps are CLOCK_REALTIME, so they can be compared to wall-clock
+ * times given on the command line.
+ *
+ * If compression is on, closed segments are rewritten by a background
+ * thread into NNNNNNNN.segz: the magic STORE_Z_MAGIC followed by blocks of
+ * at most STORE_Z_BLOCK bytes, each a struct store_zblk and the block
+ * compressed with lz_compress() (or stored as-is, if that didn't help).
+ * The index is left alone, since its offsets are into the uncompressed data.
+ */
+
+#define STORE_IDX_BYTES 4096
+
+#define STORE_Z_MAGIC "FSVZ0001"
+#define STORE_Z_BLOCK 65536
+
+struct store_rec {
+	int64_t sec;
+	int32_t nsec;
+	uint32_t len;
+};
+
+struct store_idx {
+	int64_t sec;
+	int32_t nsec;
+	uint32_t recno;
+	uint64_t off;
+};
+
+struct store_zblk {
+	uint32_t rawlen;
+	// equal to rawlen if the block is stored uncompressed
+	uint32_t zlen;
+};
+
+// statistics, shared with write_info(); protected by info_mtx
+struct fsv_store storeinfo;
+
+/*
+ * Writer state.
+ */
+
+static long seg_kib;
+static long seg_keep;
+
+static long seg_seq = 0;
+static FILE *seg_fp = NULL;
+static FILE *idx_fp = NULL;
+static uint64_t seg_off;
+static uint64_t idx_next;
+static uint32_t seg_recno;
+
+// index entries not written yet: an entry only goes out once the data
+// it points to has, so that a reader never follows one past the end
+#define STORE_IDX_PEND 64
+static struct store_idx idx_pend[STORE_IDX_PEND];
+static int idx_npend = 0;
+
+/*
+ * Compressor thread state.
+ * z_mtx protects z_next, z_upto, and z_stop, and is also held while
+ * segment files are renamed or removed, so that retention and compression
+ * never race each other.
+ */
+
+static pthread_mutex_t z_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t z_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t z_tid;
+static int z_running = 0;
+static int z_stop = 0;
+// next segment to compress, and the newest closed one
+static long z_next;
+static long z_upto;
+
+static int store_scan(long **);
+static void store_compress(long);
+static void store_idx_flush();
+static void store_seg_close();
+static int store_seg_open();
+static int store_seg_roll();
+static void *store_zmain(void *);
+
+/*
+ * Open the store in the current directory.
+ * A new segment is always started; old ones are never appended to.
+ */
+int
+store_open(long kib, long keep, int compress)
+{
+	seg_kib = kib;
+	seg_keep = keep;
+
+	pthread_mutex_lock(&info_mtx);
+	storeinfo.enabled = 1;
+	storeinfo.compress = compress;
+	pthread_mutex_unlock(&info_mtx);
+
+	if (mkdir("store", 00755) == -1 && errno != EEXIST) {
+		slog(LOG_ERR, "mkdir(store) failed: %m");
+		return -1;
+	}
+
+	long *seqs;
+	int n = store_scan(&seqs);
+	if (n == -1)
+		return -1;
+	seg_seq = (n > 0) ? seqs[n-1] : 0;
+
+	// catch up on segments left uncompressed by a previous run
+	z_next = (n > 0) ? seqs[0] : 1;
+	z_upto = seg_seq;
+	free(seqs);
+
+	if (compress) {
+		int e = pthread_create(&z_tid, NULL, store_zmain, NULL);
+		if (e != 0) {
+			errno = e;
+			slog(LOG_ERR, "pthread_create() failed: %m");
+			return -1;
+		}
+		z_running = 1;
+	}
+
+	return store_seg_open();
+}
+
+void
+store_append(const struct timespec *ts, const char *data, size_t len)
+{
+	if (seg_fp == NULL)
+		return;
+
+	if (seg_off >= (uint64_t)seg_kib * 1024 && store_seg_roll() == -1)
+		return;
+
+	int indexed = 0;
+	if (seg_off >= idx_next) {
+		struct store_idx *ix;
+
+		if (idx_npend == STORE_IDX_PEND)
+			store_idx_flush();
+		ix = &idx_pend[idx_npend++];
+		ix->sec = ts->tv_sec;
+		ix->nsec = ts->tv_nsec;
+		ix->recno = seg_recno;
+		ix->off = seg_off;
+		indexed = 1;
+	}
+
+	struct store_rec rec;
+	rec.sec = ts->tv_sec;
+	rec.nsec = ts->tv_nsec;
+	rec.len = len;
+
+	if (fwrite(&rec, sizeof(rec), 1, seg_fp) != 1 ||
+	    fwrite(data, 1, len, seg_fp) != len) {
+		slog(LOG_WARNING, "write to store segment %ld failed: %m",
+		    seg_seq);
+		// what made it in is a torn record at the end, where the
+		// reader stops; so end the segment there, without an index
+		// entry for it
+		if (indexed)
+			idx_npend--;
+		store_seg_roll();
+		return;
+	}
+
+	if (indexed)
+		idx_next = seg_off + STORE_IDX_BYTES;
+	seg_off += sizeof(rec) + len;
+	seg_recno++;
+}
+
+/*
+ * Close the current segment, hand it over to the compressor, and start
+ * the next one.
+ */
+static int
+store_seg_roll()
+{
+	store_seg_close();
+
+	pthread_mutex_lock(&z_mtx);
+	z_upto = seg_seq;
+	pthread_cond_signal(&z_cond);
+	pthread_mutex_unlock(&z_mtx);
+
+	return store_seg_open();
+}
+
+void
+store_flush()
+{
+	if (seg_fp == NULL)
+		return;
+
+	store_idx_flush();
+}
+
+/*
+ * Write out the segment, then the index entries that point into it.
+ */
+static void
+store_idx_flush()
+{
+	// entries for data that didn't make it would point past the end
+	if (fflush(seg_fp) == EOF) {
+		slog(LOG_WARNING, "write to store segment %ld failed: %m",
+		    seg_seq);
+		idx_npend = 0;
+	}
+	if (idx_npend > 0 &&
+	    fwrite(idx_pend, sizeof(*idx_pend), idx_npend, idx_fp) != idx_npend)
+		slog(LOG_WARNING, "write to store index %ld failed: %m",
+		    seg_seq);
+	idx_npend = 0;
+	fflush(idx_fp);
+}
+
+/*
+ * Close the store for good.
+ * The last segment is left uncompressed, to be picked up next time.
+ */
+void
+store_close()
+{
+	store_seg_close();
+
+	if (z_running) {
+		pthread_mutex_lock(&z_mtx);
+		z_stop = 1;
+		pthread_cond_signal(&z_cond);
+		pthread_mutex_unlock(&z_mtx);
+
+		pthread_join(z_tid, NULL);
+		z_running = 0;
+	}
+}
+
+static void
+store_seg_close()
+{
+	if (seg_fp == NULL)
+		return;
+
+	store_idx_flush();
+	fclose(seg_fp);
+	fclose(idx_fp);
+	idx_fp = seg_fp = NULL;
+}
+
+/*
+ * Start segment seg_seq+1 and drop the ones that fell out of seg_keep.
+ */
+static int
+store_seg_open()
+{
+	char path[32];
+
+	seg_seq++;
+	seg_off = 0;
+	idx_next = 0;
+	seg_recno = 0;
+	idx_npend = 0;
+
+	snprintf(path, sizeof(path), "store/%08ld.seg", seg_seq);
+	seg_fp = fopen(path, "w");
+	if (seg_fp == NULL) {
+		slog(LOG_ERR, "fopen(%s) failed: %m", path);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "store/%08ld.idx", seg_seq);
+	idx_fp = fopen(path, "w");
+	if (idx_fp == NULL) {
+		slog(LOG_ERR, "fopen(%s) failed: %m", path);
+		fclose(seg_fp);
+		seg_fp = NULL;
+		return -1;
+	}
+
+	// everything that fell out, not only the one that just did: the
+	// store may have been kept longer before, or a rotation missed
+	if (seg_seq > seg_keep) {
+		long *seqs;
+		int n = store_scan(&seqs);
+
+		pthread_mutex_lock(&z_mtx);
+		for (int i=0; i<n && seqs[i] <= seg_seq - seg_keep; i++) {
+			snprintf(path, sizeof(path), "store/%08ld.seg", seqs[i]);
+			unlink(path);
+			snprintf(path, sizeof(path), "store/%08ld.segz", seqs[i]);
+			unlink(path);
+			snprintf(path, sizeof(path), "store/%08ld.idx", seqs[i]);
+			unlink(path);
+		}
+		pthread_mutex_unlock(&z_mtx);
+		if (n != -1)
+			free(seqs);
+	}
+
+	slog(LOG_DEBUG, "store: opened segment %ld", seg_seq);
+	return 0;
+}
+
+/*
+ * Compress closed segments as they come in.
+ */
+static void *
+store_zmain(void *arg)
+{
+	long seq;
+
+#ifdef __linux__
+	// on linux, this only affects the calling thread
+	setpriority(PRIO_PROCESS, 0, 19);
+#endif
+
+	pthread_mutex_lock(&z_mtx);
+	while (1) {
+		while (!z_stop && z_next > z_upto)
+			pthread_cond_wait(&z_cond, &z_mtx);
+		if (z_stop)
+			break;
+
+		seq = z_next++;
+		pthread_mutex_unlock(&z_mtx);
+		store_compress(seq);
+		pthread_mutex_lock(&z_mtx);
+	}
+	pthread_mutex_unlock(&z_mtx);
+
+	return NULL;
+}
+
+/*
+ * Rewrite segment `seq' as a .segz, if it is still there.
+ */
+static void
+store_compress(long seq)
+{
+	char path[32], zpath[32], tpath[32];
+	unsigned char *raw = NULL, *z = NULL;
+	FILE *fp;
+	struct stat st;
+	size_t zsize;
+
+	snprintf(path, sizeof(path), "store/%08ld.seg", seq);
+	snprintf(zpath, sizeof(zpath), "store/%08ld.segz", seq);
+	snprintf(tpath, sizeof(tpath), "store/%08ld.tmp", seq);
+
+	// read it all in; segments are small
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+	if (fstat(fileno(fp), &st) == 0 && st.st_size == 0) {
+		// nothing to gain
+		fclose(fp);
+		return;
+	}
+	if (fstat(fileno(fp), &st) == -1 ||
+	    (raw = malloc(st.st_size)) == NULL ||
+	    fread(raw, 1, st.st_size, fp) != st.st_size) {
+		slog(LOG_WARNING, "store: reading segment %ld failed", seq);
+		fclose(fp);
+		free(raw);
+		return;
+	}
+	fclose(fp);
+
+	// worst case is a little over the input size
+	size_t cap = st.st_size + 16 +
+	    (st.st_size / STORE_Z_BLOCK + 1) * sizeof(struct store_zblk);
+	z = malloc(cap);
+	if (z == NULL) {
+		free(raw);
+		return;
+	}
+
+	memcpy(z, STORE_Z_MAGIC, 8);
+	zsize = 8;
+	for (off_t off = 0; off < st.st_size; off += STORE_Z_BLOCK) {
+		struct store_zblk blk;
+		size_t n = st.st_size - off;
+		if (n > STORE_Z_BLOCK)
+			n = STORE_Z_BLOCK;
+
+		unsigned char *dst = z + zsize + sizeof(blk);
+		blk.rawlen = n;
+		blk.zlen = lz_compress(raw + off, n, dst, n - 1);
+		if (blk.zlen == 0) {
+			memcpy(dst, raw + off, n);
+			blk.zlen = n;
+		}
+		memcpy(z + zsize, &blk, sizeof(blk));
+		zsize += sizeof(blk) + blk.zlen;
+	}
+	free(raw);
+
+	fp = fopen(tpath, "w");
+	if (fp == NULL || fwrite(z, 1, zsize, fp) != zsize || fclose(fp) != 0) {
+		slog(LOG_WARNING, "store: writing %s failed: %m", tpath);
+		unlink(tpath);
+		free(z);
+		return;
+	}
+	free(z);
+
+	// swap it in, unless retention got to the segment first
+	pthread_mutex_lock(&z_mtx);
+	if (access(path, F_OK) == 0 && rename(tpath, zpath) == 0) {
+		unlink(path);
+	} else {
+		unlink(tpath);
+		zsize = 0;
+	}
+	pthread_mutex_unlock(&z_mtx);
+
+	if (zsize == 0)
+		return;
+
+	struct timespec cpu;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+	pthread_mutex_lock(&info_mtx);
+	storeinfo.z_segs++;
+	storeinfo.z_in += st.st_size;
+	storeinfo.z_out += zsize;
+	storeinfo.z_cpu = cpu;
+	pthread_mutex_unlock(&info_mtx);
+	sync_info();
+
+	slog(LOG_DEBUG, "store: compressed segment %ld, %lld -> %zu bytes",
+	    seq, (long long)st.st_size, zsize);
+}
+
+/*
+ * Find the sequence numbers of all segments in store/, sorted.
+ * Returns the count, or -1 on error.
+ */
+static int
+store_scan(long **seqs)
+{
+	DIR *d;
+	struct dirent *de;
+	int n = 0;
+	int cap = 16;
+
+	*seqs = malloc(cap * sizeof(long));
+	if (*seqs == NULL)
+		return -1;
+
+	d = opendir("store");
+	if (d == NULL) {
+		slog(LOG_ERR, "opendir(store) failed: %m");
+		free(*seqs);
+		return -1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		char *ep;
+		long seq = strtol(de->d_name, &ep, 10);
+		if (ep == de->d_name ||
+		    (strcmp(ep, ".seg") != 0 && strcmp(ep, ".segz") != 0))
+			continue;
+
+		if (n == cap) {
+			cap *= 2;
+			long *p = realloc(*seqs, cap * sizeof(long));
+			if (p == NULL) {
+				closedir(d);
+				free(*seqs);
+				return -1;
+			}
+			*seqs = p;
+		}
+		(*seqs)[n++] = seq;
+	}
+	closedir(d);
+
+	// insertion sort; there are only ever a handful
+	for (int i=1; i<n; i++) {
+		long v = (*seqs)[i];
+		int j = i;
+		for (; j > 0 && (*seqs)[j-1] > v; j--)
+			(*seqs)[j] = (*seqs)[j-1];
+		(*seqs)[j] = v;
+	}
+
+	// both files exist for a moment while a segment is being compressed
+	int m = 0;
+	for (int i=0; i<n; i++)
+		if (m == 0 || (*seqs)[m-1] != (*seqs)[i])
+			(*seqs)[m++] = (*seqs)[i];
+
+	return m;
+}
+
+/*
+ * Reader side.
+ */
+
+struct seg {
+	long seq;
+	FILE *fp;
+	struct store_idx *idx;
+	size_t nidx;
+	// backing memory for fp, if the segment was compressed
+	unsigned char *zbuf;
+};
+
+/*
+ * Decompress a .segz into memory and open it as a stream,
+ * so that the rest of the reader doesn't have to care.
+ */
+static FILE *
+seg_zopen(const char *path, unsigned char **bufp)
+{
+	FILE *fp;
+	struct stat st;
+	unsigned char *z = NULL, *raw = NULL;
+	size_t rawsize = 0;
+
+	*bufp = NULL;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return NULL;
+	if (fstat(fileno(fp), &st) == -1 || st.st_size < 8 ||
+	    (z = malloc(st.st_size)) == NULL ||
+	    fread(z, 1, st.st_size, fp) != st.st_size ||
+	    memcmp(z, STORE_Z_MAGIC, 8) != 0) {
+		fclose(fp);
+		free(z);
+		return NULL;
+	}
+	fclose(fp);
+
+	// first pass for the size, second to decompress
+	for (int pass=0; pass<2; pass++) {
+		size_t off = 8;
+		size_t out = 0;
+
+		while (off + sizeof(struct store_zblk) <= st.st_size) {
+			struct store_zblk blk;
+			memcpy(&blk, z + off, sizeof(blk));
+			off += sizeof(blk);
+			if (blk.zlen > st.st_size - off)
+				goto corrupt;
+
+			if (pass == 1) {
+				if (blk.zlen == blk.rawlen)
+					memcpy(raw + out, z + off, blk.rawlen);
+				else if (lz_decompress(z + off, blk.zlen,
+				    raw + out, blk.rawlen) != blk.rawlen)
+					goto corrupt;
+			}
+			off += blk.zlen;
+			out += blk.rawlen;
+		}
+
+		if (pass == 0) {
+			rawsize = out;
+			// fmemopen(3) does not allow a size of 0
+			if (rawsize == 0 || (raw = malloc(rawsize)) == NULL)
+				goto corrupt;
+		}
+	}
+	free(z);
+
+	fp = fmemopen(raw, rawsize, "r");
+	if (fp == NULL) {
+		free(raw);
+		return NULL;
+	}
+	*bufp = raw;
+	return fp;
+
+corrupt:
+	slog(LOG_WARNING, "%s: corrupt compressed segment", path);
+	free(z);
+	free(raw);
+	return NULL;
+}
+
+static int
+seg_load(struct seg *s, long seq)
+{
+	char path[32];
+	FILE *fp;
+	struct stat st;
+
+	s->seq = seq;
+	s->idx = NULL;
+	s->nidx = 0;
+	s->zbuf = NULL;
+
+	snprintf(path, sizeof(path), "store/%08ld.seg", seq);
+	s->fp = fopen(path, "r");
+	if (s->fp == NULL) {
+		snprintf(path, sizeof(path), "store/%08ld.segz", seq);
+		s->fp = seg_zopen(path, &s->zbuf);
+	}
+	if (s->fp == NULL)
+		return -1;
+
+	snprintf(path, sizeof(path), "store/%08ld.idx", seq);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fstat(fileno(fp), &st) == 0 && st.st_size > 0) {
+		s->idx = malloc(st.st_size);
+		if (s->idx != NULL)
+			s->nidx = fread(s->idx, sizeof(*s->idx),
+			    st.st_size / sizeof(*s->idx), fp);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/*
+ * Get the time of the first record of a segment from its index alone,
+ * without opening (or decompressing) the segment itself.
+ * Returns -1 if there is no index entry.
+ */
+static int
+seg_first(long seq, time_t *sec)
+{
+	char path[32];
+	struct store_idx ix;
+	FILE *fp;
+	int ok;
+
+	snprintf(path, sizeof(path), "store/%08ld.idx", seq);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	ok = fread(&ix, sizeof(ix), 1, fp) == 1;
+	fclose(fp);
+	if (!ok)
+		return -1;
+
+	*sec = ix.sec;
+	return 0;
+}
+
+static void
+seg_free(struct seg *s)
+{
+	if (s->fp != NULL)
+		fclose(s->fp);
+	free(s->idx);
+	free(s->zbuf);
+}
+
+/*
+ * Read the record at the current position.
+ * Returns 1 if one was read, 0 at the end (or a torn final record).
+ */
+static int
+rec_read(FILE *fp, struct store_rec *rec, char *buf)
+{
+	if (fread(rec, sizeof(*rec), 1, fp) != 1)
+		return 0;
+	if (rec->len > SINK_LINE_MAX)
+		return 0;
+	if (fread(buf, 1, rec->len, fp) != rec->len)
+		return 0;
+	return 1;
+}
+
+static void
+rec_print(struct store_rec *rec, char *buf)
+{
+	char tstr[32];
+	time_t t = rec->sec;
+	struct tm *tm = localtime(&t);
+
+	strftime(tstr, sizeof(tstr), "%F %T", tm);
+	printf("%s.%06ld ", tstr, (long)rec->nsec / 1000);
+	fwrite(buf, 1, rec->len, stdout);
+	putchar('\n');
+}
+
+/*
+ * Count the records in a segment, scanning only past its last index entry.
+ */
+static uint32_t
+seg_count(struct seg *s)
+{
+	struct store_rec rec;
+	static char buf[SINK_LINE_MAX];
+	uint32_t n = 0;
+
+	if (s->nidx > 0) {
+		n = s->idx[s->nidx-1].recno;
+		fseeko(s->fp, s->idx[s->nidx-1].off, SEEK_SET);
+	}
+	while (rec_read(s->fp, &rec, buf))
+		n++;
+
+	return n;
+}
+
+/*
+ * Position the segment at record number `recno'.
+ */
+static void
+seg_seek_rec(struct seg *s, uint32_t recno)
+{
+	struct store_rec rec;
+	static char buf[SINK_LINE_MAX];
+	uint32_t n = 0;
+	uint64_t off = 0;
+
+	for (size_t i=0; i<s->nidx && s->idx[i].recno <= recno; i++) {
+		n = s->idx[i].recno;
+		off = s->idx[i].off;
+	}
+
+	fseeko(s->fp, off, SEEK_SET);
+	for (; n < recno; n++)
+		if (!rec_read(s->fp, &rec, buf))
+			break;
+}
+
+/*
+ * Position the segment at the last index entry before time `t'.
+ */
+static void
+seg_seek_time(struct seg *s, time_t t)
+{
+	size_t lo = 0, hi = s->nidx;
+	uint64_t off = 0;
+
+	// find the last entry with a timestamp before t
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (s->idx[mid].sec < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		off = s->idx[lo-1].off;
+
+	fseeko(s->fp, off, SEEK_SET);
+}
+
+/*
+ * Print records from the store of service `name'.
+ * If `last' is non-zero, print the final `last' records;
+ * otherwise print those with since <= time < until.
+ * This function does not return, and instead calls exit(3).
+ */
+void
+store_query(uid_t u, char *name, time_t since, time_t until, long last)
+{
+	/*
+	 * cd to the directory.
+	 */
+
+	{
+		char *dir;
+
+		if (asprintf(&dir, "%s/fsv-%ld/%s",
+		    FSV_STATE_PREFIX, (long)u, name) == -1) {
+			slog(LOG_ERR, "asprintf: %m");
+			exit(1);
+		}
+		if (chdir(dir) == -1) {
+			slog(LOG_ERR, "chdir(%s) failed: %m", dir);
+			exit(1);
+		}
+		free(dir);
+	}
+
+	long *seqs;
+	int nseg;
+
+	nseg = store_scan(&seqs);
+	if (nseg == -1)
+		exit(1);
+
+	struct store_rec rec;
+	static char buf[SINK_LINE_MAX];
+
+	/*
+	 * Find where to start: segment `first', positioned appropriately.
+	 */
+
+	int first = 0;
+	struct seg s;
+
+	if (last > 0) {
+		// walk backwards until enough records are found
+		uint32_t skip = 0;
+
+		for (first = nseg-1; first >= 0; first--) {
+			if (seg_load(&s, seqs[first]) == -1)
+				continue;
+			uint32_t cnt = seg_count(&s);
+			seg_free(&s);
+
+			if (cnt >= last) {
+				skip = cnt - last;
+				break;
+			}
+			last -= cnt;
+		}
+		if (first < 0)
+			first = 0;
+
+		if (nseg > 0 && seg_load(&s, seqs[first]) == 0)
+			seg_seek_rec(&s, skip);
+		else
+			s.fp = NULL;
+	} else {
+		// binary search over segments by their first timestamp
+		int lo = 0, hi = nseg;
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			time_t t;
+			int before = 0;
+
+			if (seg_first(seqs[mid], &t) == 0)
+				before = t < since;
+
+			if (before)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		first = (lo > 0) ? lo - 1 : 0;
+		s.fp = NULL;
+	}
+
+	/*
+	 * Then print forward, up to the first segment that starts too late.
+	 */
+
+	for (int i=first; i<nseg; i++) {
+		if (last == 0) {
+			time_t t;
+
+			if (seg_first(seqs[i], &t) == 0 && t >= until)
+				break;
+			if (seg_load(&s, seqs[i]) == -1)
+				continue;
+			if (i == first)
+				seg_seek_time(&s, since);
+		} else if (i != first && seg_load(&s, seqs[i]) == -1)
+			continue;
+		if (s.fp == NULL)
+			continue;
+
+		while (rec_read(s.fp, &rec, buf)) {
+			if (last == 0) {
+				if (rec.sec < since)
+					continue;
+				if (rec.sec >= until) {
+					seg_free(&s);
+					goto done;
+				}
+			}
+			rec_print(&rec, buf);
+		}
+		seg_free(&s);
+		s.fp = NULL;
+	}
+
+done:
+	free(seqs);
+	exit(0);
+}
+
+/*
+ * Parse a time given on the command line.
+ * Accepts @SECONDS since the epoch, "YYYY-MM-DD HH:MM[:SS]",
+ * or "HH:MM[:SS]" meaning today.
+ * Returns -1 if the format is not recognized.
+ */
+time_t
+store_parse_time(const char *str)
+{
+	struct tm tm;
+	const char *ep;
+	time_t now;
+
+	if (*str == '@') {
+		char *lep;
+		long long v = strtoll(str + 1, &lep, 10);
+		if (lep == str + 1 || *lep != '\0')
+			return -1;
+		return (time_t)v;
+	}
+
+	const char *datefmts[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d",
+	};
+	for (int i=0; i<sizeof(datefmts)/sizeof(datefmts[0]); i++) {
+		memset(&tm, 0, sizeof(tm));
+		ep = strptime(str, datefmts[i], &tm);
+		if (ep != NULL && *ep == '\0') {
+			tm.tm_isdst = -1;
+			return mktime(&tm);
+		}
+	}
+
+	const char *timefmts[] = { "%H:%M:%S", "%H:%M" };
+	for (int i=0; i<sizeof(timefmts)/sizeof(timefmts[0]); i++) {
+		time(&now);
+		localtime_r(&now, &tm);
+		tm.tm_sec = 0;
+		ep = strptime(str, timefmts[i], &tm);
+		if (ep != NULL && *ep == '\0') {
+			tm.tm_isdst = -1;
+			return mktime(&tm);
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,434 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * Service files, for -f.
+ *
+ * A service file has one setting per line: the name of a long option and
+ * its argument, if any, as in
+ *
+ *	# sshd, restarted at most 5 times a minute
+ *	cmd /usr/sbin/sshd -D
+ *	log logger -t sshd
+ *	max-execs 5
+ *	recent-secs 60
+ *	env LANG=C
+ *
+ * Blank lines and lines starting with `#' are ignored.
+ * `cmd' gives the command, split into words like -l; everything else is
+ * passed on as `--key value', so anything that can be given as a long
+ * option can be set, and is checked against the long options here.
+ * The name defaults to the base name of the file.
+ *
+ * The result is a list of words to go in front of the command line.
+ * It is cached in `.svc/' in the fsvdir, in a file that is simply mmap'd
+ * the next time, as long as the service file hasn't changed.
+ */
+
+#define SVC_MAGIC	"FSVSVC01"
+
+struct svc_hdr {
+	char magic[8];
+	// the service file this was compiled from
+	int64_t dev;
+	int64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	// number of words, and how many of the last ones are cmd
+	uint32_t nwords;
+	uint32_t ncmd;
+	// followed by the words, each terminated by a NUL
+};
+
+/*
+ * Split `s' in place into words separated by blanks; a word in double
+ * quotes may contain blanks.
+ * *argvp is set to a NULL-terminated array of them.
+ * Returns the number of words, or -1 for an unmatched double quote.
+ */
+int
+split_words(char *s, char ***argvp)
+{
+	char **v = NULL;
+	int n = 0;
+	int cap = 0;
+	char *c = s;
+
+	while (1) {
+		// consume any leading blanks
+		while (*c == ' ' || *c == '\t') {
+			*c = '\0';
+			c++;
+		}
+
+		// end of string
+		if (*c == '\0')
+			break;
+
+		if (n + 2 > cap) {
+			cap = cap ? cap * 2 : 8;
+			v = realloc(v, cap * sizeof(*v));
+			if (v == NULL) {
+				slog(LOG_ERR, "realloc() failed: %m");
+				exit(1);
+			}
+		}
+
+		if (*c != '"') {
+			// normal argument
+			v[n++] = c;
+			while (*c != ' ' && *c != '\t' && *c != '\0')
+				c++;
+		} else {
+			// double-quoted argument
+			*c = '\0';
+			c++;
+			v[n++] = c;
+
+			while (*c != '"' && *c != '\0')
+				c++;
+
+			if (*c == '\0') {
+				free(v);
+				return -1;
+			}
+			*c = '\0';
+			c++;
+		}
+	}
+
+	if (v == NULL && (v = malloc(sizeof(*v))) == NULL) {
+		slog(LOG_ERR, "malloc() failed: %m");
+		exit(1);
+	}
+	v[n] = NULL;
+	*argvp = v;
+	return n;
+}
+
+/*
+ * Where the cache for a service file lives:
+ * its absolute path with `/' turned into `%', under .svc/ in the fsvdir.
+ * Creates the directories if needed.
+ */
+static char *
+svc_cache_path(const char *path)
+{
+	char real[PATH_MAX];
+	char *dir, *cache;
+	struct stat st;
+
+	if (realpath(path, real) == NULL)
+		return NULL;
+	for (char *c = real; *c != '\0'; c++)
+		if (*c == '/')
+			*c = '%';
+
+	if (asprintf(&dir, "%s/fsv-%ld", FSV_STATE_PREFIX, (long)geteuid())
+	    == -1)
+		return NULL;
+	// be as paranoid about the owner as main() is
+	if ((mkdir(dir, 00755) == -1 && errno != EEXIST) ||
+	    stat(dir, &st) == -1 || st.st_uid != geteuid()) {
+		free(dir);
+		return NULL;
+	}
+	free(dir);
+	if (asprintf(&dir, "%s/fsv-%ld/.svc", FSV_STATE_PREFIX,
+	    (long)geteuid()) == -1)
+		return NULL;
+	if (mkdir(dir, 00755) == -1 && errno != EEXIST) {
+		free(dir);
+		return NULL;
+	}
+	if (asprintf(&cache, "%s/%s", dir, real) == -1)
+		cache = NULL;
+	free(dir);
+	return cache;
+}
+
+/*
+ * Map the cache, if it is there and matches `st'.
+ * Returns the number of words, or -1.
+ */
+static int
+svc_map(const char *cache, const struct stat *st, char ***wordsp, int *ncmdp)
+{
+	struct stat cst;
+	struct svc_hdr *h;
+	char **words;
+	char *p, *end;
+	int fd;
+
+	fd = open(cache, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &cst) == -1 || cst.st_size < sizeof(*h) ||
+	    cst.st_uid != geteuid()) {
+		close(fd);
+		return -1;
+	}
+	h = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+		return -1;
+
+	if (memcmp(h->magic, SVC_MAGIC, 8) != 0 ||
+	    h->dev != st->st_dev || h->ino != st->st_ino ||
+	    h->size != st->st_size ||
+	    h->mtime_sec != st->st_mtim.tv_sec ||
+	    h->mtime_nsec != st->st_mtim.tv_nsec ||
+	    h->ncmd > h->nwords)
+		goto stale;
+
+	words = malloc((h->nwords + 1) * sizeof(*words));
+	if (words == NULL)
+		goto stale;
+	p = (char *)(h + 1);
+	end = (char *)h + cst.st_size;
+	for (uint32_t i=0; i<h->nwords; i++) {
+		char *nul = memchr(p, '\0', end - p);
+		if (nul == NULL) {
+			free(words);
+			goto stale;
+		}
+		words[i] = p;
+		p = nul + 1;
+	}
+	words[h->nwords] = NULL;
+
+	// the mapping stays for good; the words point into it
+	*wordsp = words;
+	*ncmdp = h->ncmd;
+	return h->nwords;
+
+stale:
+	munmap(h, cst.st_size);
+	return -1;
+}
+
+/*
+ * Write the cache, atomically.
+ */
+static void
+svc_write(const char *cache, const struct stat *st, char **words, int n,
+          int ncmd)
+{
+	struct svc_hdr h;
+	char *tmp;
+	FILE *f;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SVC_MAGIC, 8);
+	h.dev = st->st_dev;
+	h.ino = st->st_ino;
+	h.size = st->st_size;
+	h.mtime_sec = st->st_mtim.tv_sec;
+	h.mtime_nsec = st->st_mtim.tv_nsec;
+	h.nwords = n;
+	h.ncmd = ncmd;
+
+	if (asprintf(&tmp, "%s.%ld", cache, (long)getpid()) == -1)
+		return;
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		slog(LOG_DEBUG, "fopen(%s) failed: %m", tmp);
+		free(tmp);
+		return;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	for (int i=0; i<n; i++)
+		fwrite(words[i], strlen(words[i]) + 1, 1, f);
+	if (fclose(f) == EOF || rename(tmp, cache) == -1) {
+		slog(LOG_WARNING, "writing %s failed: %m", cache);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+/*
+ * Parse a service file into words.
+ * Returns the number of words, or -1 after complaining about the file.
+ */
+static int
+svc_parse(const char *path, const struct option *lo, char ***wordsp,
+          int *ncmdp)
+{
+	char **words = NULL;
+	int n = 0, cap = 0;
+	char **cmd = NULL;
+	int ncmd = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	int lineno = 0;
+	FILE *f;
+
+#define ADD(w) do {							\
+	if (n + 2 > cap) {						\
+		cap = cap ? cap * 2 : 16;				\
+		words = realloc(words, cap * sizeof(*words));		\
+		if (words == NULL) {					\
+			slog(LOG_ERR, "realloc() failed: %m");		\
+			exit(1);					\
+		}							\
+	}								\
+	words[n++] = (w);						\
+} while (0)
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		slog(LOG_ERR, "fopen(%s) failed: %m", path);
+		return -1;
+	}
+
+	// the name defaults to that of the file; a `name' line overrides it
+	{
+		char *tmp = strdup(path);
+		ADD("--name");
+		ADD(strdup(basename(tmp)));
+		free(tmp);
+	}
+
+	while (getline(&line, &linecap, f) != -1) {
+		char *key, *val, *e;
+		const struct option *o;
+
+		lineno++;
+		key = line + strspn(line, " \t");
+		key[strcspn(key, "\n")] = '\0';
+		if (*key == '\0' || *key == '#')
+			continue;
+
+		val = key + strcspn(key, " \t");
+		if (*val != '\0') {
+			*val++ = '\0';
+			val += strspn(val, " \t");
+		}
+		for (e = val + strlen(val); e > val && (e[-1] == ' ' ||
+		    e[-1] == '\t'); e--)
+			e[-1] = '\0';
+
+		if (strcmp(key, "cmd") == 0) {
+			if (cmd != NULL) {
+				slog(LOG_ERR, "%s:%d: cmd given twice",
+				    path, lineno);
+				goto bad;
+			}
+			ncmd = split_words(strdup(val), &cmd);
+			if (ncmd == -1) {
+				slog(LOG_ERR, "%s:%d: unmatched double-quote",
+				    path, lineno);
+				goto bad;
+			}
+			if (ncmd == 0) {
+				slog(LOG_ERR, "%s:%d: empty cmd", path, lineno);
+				goto bad;
+			}
+			continue;
+		}
+
+		for (o = lo; o->name != NULL; o++)
+			if (strcmp(o->name, key) == 0)
+				break;
+		if (o->name == NULL || strcmp(key, "compile") == 0) {
+			slog(LOG_ERR, "%s:%d: unknown setting `%s'",
+			    path, lineno, key);
+			goto bad;
+		}
+		if (o->has_arg == required_argument && *val == '\0') {
+			slog(LOG_ERR, "%s:%d: `%s' needs a value",
+			    path, lineno, key);
+			goto bad;
+		}
+		if (o->has_arg == no_argument && *val != '\0') {
+			slog(LOG_ERR, "%s:%d: `%s' takes no value",
+			    path, lineno, key);
+			goto bad;
+		}
+
+		char *opt;
+		if (asprintf(&opt, "--%s", key) == -1) {
+			slog(LOG_ERR, "asprintf: %m");
+			exit(1);
+		}
+		ADD(opt);
+		if (o->has_arg != no_argument)
+			ADD(strdup(val));
+	}
+	fclose(f);
+	free(line);
+
+	if (cmd != NULL) {
+		ADD("--");
+		for (int i=0; i<ncmd; i++)
+			ADD(cmd[i]);
+	}
+	words[n] = NULL;
+#undef ADD
+
+	*wordsp = words;
+	*ncmdp = ncmd;
+	return n;
+
+bad:
+	fclose(f);
+	free(line);
+	return -1;
+}
+
+/*
+ * Load the service file at `path', from the cache if it is up to date;
+ * otherwise, or if `compile', parse it and write the cache.
+ * `lo' are the long options a setting can be.
+ * *wordsp is set to the words to put in front of the command line;
+ * the last *ncmdp of them are cmd, after a "--".
+ * Returns the number of words, or -1.
+ */
+int
+svc_load(const char *path, const struct option *lo, char ***wordsp,
+         int *ncmdp, int compile)
+{
+	struct stat st;
+	char *cache;
+	int n;
+
+	if (stat(path, &st) == -1) {
+		slog(LOG_ERR, "stat(%s) failed: %m", path);
+		return -1;
+	}
+
+	cache = svc_cache_path(path);
+	if (cache != NULL && !compile) {
+		n = svc_map(cache, &st, wordsp, ncmdp);
+		if (n != -1) {
+			slog(LOG_DEBUG, "loaded %s from %s", path, cache);
+			free(cache);
+			return n;
+		}
+	}
+
+	n = svc_parse(path, lo, wordsp, ncmdp);
+	if (n != -1 && cache != NULL) {
+		svc_write(cache, &st, *wordsp, n, *ncmdp);
+		slog(LOG_DEBUG, "compiled %s into %s", path, cache);
+	}
+	free(cache);
+	return n;
+}
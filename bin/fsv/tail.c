@@ -0,0 +1,315 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>	// for LOG_* level constants
+#include <time.h>
+#include <unistd.h>
+
+#include <slog.h>
+
+#include "extern.h"
+
+/*
+ * The live tail: the most recent output of cmd, kept by the sink in a
+ * memory-mapped ring in the file `tail', for --tail to read.
+ *
+ * There is a single writer and any number of readers, which never block it.
+ * The header holds the total number of bytes ever written (`head');
+ * byte N of the stream lives at data[N % size].
+ * The writer first publishes how far it is about to write (`writing'),
+ * then copies data in, then publishes the new head.
+ * A reader copies what it wants out, then reads `writing', and throws
+ * away the part the writer may have overwritten, or be overwriting,
+ * in the meantime.
+ *
+ * A writer with a different size replaces the file instead of resizing it,
+ * so that readers never see it shrink under them.
+ */
+
+#define TAIL_MAGIC	"FSVTAIL1"
+// data starts here, after the header
+#define TAIL_DATA	64
+
+// how long a follower sleeps when there is nothing new, in ms
+#define TAIL_POLL	100
+
+struct tail_hdr {
+	char magic[8];
+	uint64_t size;
+	uint64_t head;
+	uint64_t writing;
+};
+
+static struct tail_hdr *hdr = NULL;
+static char *data;
+
+/*
+ * Open the ring for writing, keeping what is in it if it has the right size.
+ */
+int
+tail_open(long kib)
+{
+	uint64_t size = (uint64_t)kib * 1024;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open("tail", O_RDWR|O_CLOEXEC);
+	if (fd != -1 && fstat(fd, &st) == 0 &&
+	    st.st_size == TAIL_DATA + size) {
+		p = mmap(NULL, TAIL_DATA + size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED && memcmp(p, TAIL_MAGIC, 8) == 0 &&
+		    ((struct tail_hdr *)p)->size == size) {
+			close(fd);
+			hdr = p;
+			data = (char *)p + TAIL_DATA;
+			// a write cut short by a crash is in the past now
+			hdr->writing = hdr->head;
+			return 0;
+		}
+		if (p != MAP_FAILED)
+			munmap(p, TAIL_DATA + size);
+	}
+	if (fd != -1)
+		close(fd);
+
+	// start over in a new file
+	fd = open("tail.new", O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC, 00644);
+	if (fd == -1) {
+		slog(LOG_ERR, "open(tail.new) failed: %m");
+		return -1;
+	}
+	if (ftruncate(fd, TAIL_DATA + size) == -1) {
+		slog(LOG_ERR, "ftruncate(tail.new) failed: %m");
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, TAIL_DATA + size, PROT_READ|PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		slog(LOG_ERR, "mmap(tail.new) failed: %m");
+		return -1;
+	}
+	hdr = p;
+	data = (char *)p + TAIL_DATA;
+	memcpy(hdr->magic, TAIL_MAGIC, 8);
+	hdr->size = size;
+	hdr->head = 0;
+	hdr->writing = 0;
+
+	if (rename("tail.new", "tail") == -1) {
+		slog(LOG_ERR, "rename(tail.new, tail) failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add bytes to the ring.
+ */
+void
+tail_append(const char *s, size_t len)
+{
+	uint64_t head = hdr->head;
+	uint64_t size = hdr->size;
+
+	// only the last `size' bytes would survive anyway
+	if (len > size) {
+		head += len - size;
+		s += len - size;
+		len = size;
+	}
+
+	// readers must see this before any of the data changes
+	__atomic_store_n(&hdr->writing, head + len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	size_t off = head % size;
+	size_t n = (len < size - off) ? len : size - off;
+	memcpy(data + off, s, n);
+	memcpy(data, s + n, len - n);
+
+	__atomic_store_n(&hdr->head, head + len, __ATOMIC_RELEASE);
+}
+
+/*
+ * Map the ring read-only. Returns -1 if there isn't a usable one.
+ */
+static int
+tail_map(struct stat *st)
+{
+	void *p;
+	int fd;
+
+	fd = open("tail", O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, st) == -1 || st->st_size <= TAIL_DATA) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	hdr = p;
+	data = (char *)p + TAIL_DATA;
+	if (memcmp(hdr->magic, TAIL_MAGIC, 8) != 0 ||
+	    hdr->size != st->st_size - TAIL_DATA) {
+		munmap(p, st->st_size);
+		hdr = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the stream from byte `*pos' up to the current head into `buf'.
+ * `*pos' is moved up if the writer got more than a ring ahead of it,
+ * and `*skip' is set to the number of bytes at the start of `buf'
+ * that were overwritten while copying.
+ * Returns the head.
+ */
+static uint64_t
+tail_copy(uint64_t *posp, char *buf, size_t *skip)
+{
+	uint64_t size = hdr->size;
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	uint64_t pos = *posp;
+
+	if (pos > head)
+		pos = head;
+	if (head - pos > size)
+		pos = head - size;
+
+	for (uint64_t i = pos; i < head; ) {
+		size_t off = i % size;
+		size_t n = size - off;
+		if (n > head - i)
+			n = head - i;
+		memcpy(buf + (i - pos), data + off, n);
+		i += n;
+	}
+
+	// drop whatever was overwritten while copying, or is being
+	// overwritten right now; a ring from an older writer only has head
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint64_t now = __atomic_load_n(&hdr->writing, __ATOMIC_RELAXED);
+	if (now < head)
+		now = head;
+	*skip = 0;
+	if (now > size && now - size > pos)
+		*skip = ((now - size < head) ? now - size : head) - pos;
+	*posp = pos;
+	return head;
+}
+
+/*
+ * Print what is in the ring and, if `follow', keep printing as more comes.
+ * This function does not return, and instead calls exit(3).
+ */
+void
+tail_follow(uid_t u, char *name, int follow)
+{
+	/*
+	 * cd to the directory.
+	 */
+
+	{
+		char *dir;
+
+		if (asprintf(&dir, "%s/fsv-%ld/%s",
+		    FSV_STATE_PREFIX, (long)u, name) == -1) {
+			slog(LOG_ERR, "asprintf: %m");
+			exit(1);
+		}
+		if (chdir(dir) == -1) {
+			slog(LOG_ERR, "chdir(%s) failed: %m", dir);
+			exit(1);
+		}
+		free(dir);
+	}
+
+	struct stat st;
+	if (tail_map(&st) == -1) {
+		slog(LOG_ERR, "no live tail for %s (not started with "
+		    "--tail-size?)", name);
+		exit(1);
+	}
+
+	char *buf = malloc(hdr->size);
+	if (buf == NULL) {
+		slog(LOG_ERR, "malloc() failed: %m");
+		exit(1);
+	}
+
+	uint64_t pos = 0;
+	int first = 1;
+
+	for (;;) {
+		uint64_t want = pos;
+		size_t skip;
+		uint64_t head = tail_copy(&pos, buf, &skip);
+		char *s = buf + skip;
+		size_t len = head - pos - skip;
+
+		// if the beginning was lost, start at a line
+		if (pos + skip != want && len > 0) {
+			char *nl = memchr(s, '\n', len);
+			if (!first)
+				slog(LOG_WARNING, "fell behind, %llu bytes "
+				    "of output lost",
+				    (unsigned long long)(pos + skip - want));
+			if (nl != NULL) {
+				len -= nl + 1 - s;
+				s = nl + 1;
+			}
+		}
+		first = 0;
+
+		if (len > 0 && fwrite(s, 1, len, stdout) != len)
+			exit(1);
+		pos = head;
+		if (!follow)
+			break;
+		if (len > 0)
+			continue;
+
+		fflush(stdout);
+		struct timespec ts = { 0, TAIL_POLL * 1000000 };
+		nanosleep(&ts, NULL);
+
+		// a new fsv may have replaced the ring
+		struct stat nst;
+		if (stat("tail", &nst) == 0 &&
+		    (nst.st_ino != st.st_ino || nst.st_dev != st.st_dev)) {
+			size_t osize = hdr->size;
+			munmap(hdr, st.st_size);
+			if (tail_map(&st) == -1) {
+				slog(LOG_ERR, "tail went away: %m");
+				exit(1);
+			}
+			if (hdr->size != osize) {
+				free(buf);
+				buf = malloc(hdr->size);
+				if (buf == NULL) {
+					slog(LOG_ERR, "malloc() failed: %m");
+					exit(1);
+				}
+			}
+			pos = 0;
+		}
+	}
+
+	fflush(stdout);
+	exit(0);
+}
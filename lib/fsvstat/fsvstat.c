@@ -0,0 +1,589 @@
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "fsvstat.h"
+
+/*
+ * info.struct is rewritten in place by fsv with pwrite(2), which a read
+ * can overlap with; a read is trusted once two in a row agree.
+ *
+ * Changes are seen with inotify. There are only a few instances per user
+ * (fs.inotify.max_user_instances, 128 by default), so all handles share
+ * one, with a watch on each service directory; whatever reads events
+ * from it hands them out to the handles they are for. A handle that
+ * can't have a watch finds changes by reading info.struct every
+ * FSVSTAT_POLL_MS instead, and fsvstat_polling() says why.
+ *
+ * Of the threads in fsvstat_wait(), one at a time polls the instance,
+ * and the others wait on ino_cond. Whoever reads events while it polls
+ * wakes it through ino_wake, since they may be for it.
+ */
+
+#define FSVSTAT_TRIES	10
+#define FSVSTAT_POLL_MS	100
+
+struct fsvstat {
+	char *name;
+	int fd;
+	// watch on the service directory, -1 for none, and why not
+	int wd;
+	int ino_errno;
+	// set when an event for it came in since the last snapshot
+	int changed;
+	// for the reads that must agree, and what the last snapshot saw
+	struct allinfo tmp;
+	struct allinfo last;
+	int have_last;
+	// all handles with a watch
+	struct fsvstat *next;
+};
+
+// the shared instance, -1 if none, and the handles that use it
+static pthread_mutex_t ino_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int ino_fd = -1;
+static struct fsvstat *watched = NULL;
+// true while a thread polls ino_fd; an eventfd to wake it, and where
+// the other threads wait
+static int ino_polling = 0;
+static int ino_wake = -1;
+static pthread_cond_t ino_cond;
+static pthread_once_t ino_once = PTHREAD_ONCE_INIT;
+
+static char *
+state_dir(uid_t u)
+{
+	char *dir;
+
+	if (asprintf(&dir, "%s/fsv-%ld", FSV_STATE_PREFIX, (long)u) == -1)
+		return NULL;
+	return dir;
+}
+
+#ifdef __linux__
+/*
+ * Hand out the events waiting on the shared instance.
+ * Call with ino_mtx held.
+ */
+static void
+ino_dispatch()
+{
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int got = 0;
+	ssize_t r;
+
+	while ((r = read(ino_fd, buf, sizeof(buf))) > 0) {
+		got = 1;
+		for (char *p = buf; p < buf + r; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			for (fsvstat *h = watched; h != NULL; h = h->next) {
+				// events were lost; anything may have changed
+				if (ev->mask & IN_Q_OVERFLOW)
+					h->changed = 1;
+				if (h->wd != ev->wd)
+					continue;
+				if (ev->mask & IN_IGNORED) {
+					// the directory went away
+					h->changed = 1;
+					h->wd = -1;
+					h->ino_errno = ENOENT;
+				} else if (ev->len > 0 &&
+				    strcmp(ev->name, "info.struct") == 0)
+					h->changed = 1;
+			}
+		}
+	}
+	if (!got)
+		return;
+	if (ino_polling) {
+		uint64_t one = 1;
+		write(ino_wake, &one, sizeof(one));
+	}
+	pthread_cond_broadcast(&ino_cond);
+}
+
+static void
+ino_cond_init()
+{
+	pthread_condattr_t ca;
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&ino_cond, &ca);
+	pthread_condattr_destroy(&ca);
+}
+
+/*
+ * Watch the directory of `h', whose info.struct is at `path'.
+ * Call with ino_mtx held.
+ */
+static void
+ino_watch(fsvstat *h, char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (ino_fd == -1) {
+		ino_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+		if (ino_fd == -1) {
+			h->ino_errno = errno;
+			return;
+		}
+		ino_wake = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (ino_wake == -1) {
+			h->ino_errno = errno;
+			close(ino_fd);
+			ino_fd = -1;
+			return;
+		}
+	}
+
+	// the directory, so that one watch is enough however many
+	// handles there are for it
+	*slash = '\0';
+	h->wd = inotify_add_watch(ino_fd, path, IN_MODIFY|IN_ONLYDIR);
+	*slash = '/';
+	if (h->wd == -1) {
+		h->ino_errno = errno;
+		if (watched == NULL) {
+			close(ino_fd);
+			close(ino_wake);
+			ino_fd = -1;
+			ino_wake = -1;
+		}
+		return;
+	}
+	h->next = watched;
+	watched = h;
+}
+
+/*
+ * Stop watching for `h'.
+ * Call with ino_mtx held.
+ */
+static void
+ino_unwatch(fsvstat *h)
+{
+	int shared = 0;
+
+	for (fsvstat **hp = &watched; *hp != NULL; hp = &(*hp)->next)
+		if (*hp == h) {
+			*hp = h->next;
+			break;
+		}
+	for (fsvstat *o = watched; o != NULL; o = o->next)
+		if (o->wd == h->wd)
+			shared = 1;
+	if (h->wd != -1 && !shared)
+		inotify_rm_watch(ino_fd, h->wd);
+	if (watched == NULL && ino_fd != -1) {
+		close(ino_fd);
+		close(ino_wake);
+		ino_fd = -1;
+		ino_wake = -1;
+	}
+}
+#endif
+
+/*
+ * Open the service `name' of user `u'.
+ * Returns NULL and sets errno if it has never run.
+ */
+fsvstat *
+fsvstat_open(uid_t u, const char *name)
+{
+	fsvstat *h;
+	char *path;
+
+	if (*name == '\0' || *name == '.' || strchr(name, '/') != NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (asprintf(&path, "%s/fsv-%ld/%s/info.struct",
+	    FSV_STATE_PREFIX, (long)u, name) == -1)
+		return NULL;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL || (h->name = strdup(name)) == NULL) {
+		free(h);
+		free(path);
+		return NULL;
+	}
+	h->fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (h->fd == -1) {
+		int e = errno;
+		free(path);
+		free(h->name);
+		free(h);
+		errno = e;
+		return NULL;
+	}
+
+	h->wd = -1;
+#ifdef __linux__
+	pthread_mutex_lock(&ino_mtx);
+	ino_watch(h, path);
+	pthread_mutex_unlock(&ino_mtx);
+#else
+	h->ino_errno = ENOSYS;
+#endif
+	free(path);
+	return h;
+}
+
+void
+fsvstat_close(fsvstat *h)
+{
+	if (h == NULL)
+		return;
+	close(h->fd);
+#ifdef __linux__
+	pthread_mutex_lock(&ino_mtx);
+	ino_unwatch(h);
+	pthread_mutex_unlock(&ino_mtx);
+#endif
+	free(h->name);
+	free(h);
+}
+
+const char *
+fsvstat_name(const fsvstat *h)
+{
+	return h->name;
+}
+
+/*
+ * Read info.struct as fsv wrote it into `buf', which must be `size'
+ * bytes, the size of struct allinfo.
+ * Returns -1 with errno EPROTO if it was written by another version of
+ * fsv, or EAGAIN if it kept changing.
+ */
+int
+fsvstat_raw(fsvstat *h, void *buf, size_t size)
+{
+	struct stat st;
+
+	if (size != sizeof(struct allinfo)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fstat(h->fd, &st) == -1)
+		return -1;
+	if (st.st_size != sizeof(struct allinfo)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	for (int i=0; i<FSVSTAT_TRIES; i++) {
+		if (pread(h->fd, buf, size, 0) != size ||
+		    pread(h->fd, &h->tmp, size, 0) != size) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (memcmp(buf, &h->tmp, size) == 0)
+			return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * CLOCK_MONOTONIC time `t' as CLOCK_REALTIME.
+ */
+static struct timespec
+mono_to_real(const struct timespec *t)
+{
+	struct timespec mono, real, r;
+	long long ns;
+
+	if (t->tv_sec == 0 && t->tv_nsec == 0)
+		return *t;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	ns = (real.tv_sec - mono.tv_sec + t->tv_sec) * 1000000000LL +
+	    real.tv_nsec - mono.tv_nsec + t->tv_nsec;
+	r.tv_sec = ns / 1000000000;
+	r.tv_nsec = ns % 1000000000;
+	return r;
+}
+
+static void
+proc_fill(struct fsvstat_proc *p, const struct fsv_child *c)
+{
+	p->pid = c->pid;
+	p->since = mono_to_real(&c->since);
+	p->total_execs = c->total_execs;
+	p->recent_execs = c->recent_execs;
+	p->max_recent_execs = c->max_recent_execs;
+	p->recent_secs = c->recent_secs;
+	p->ready = c->ready_fd == 0 ? -1 : c->ready;
+	p->frozen = c->frozen;
+	p->queued = c->queued;
+	p->deferred = c->deferred;
+}
+
+/*
+ * Fill in `info', of `size' bytes as the caller knows it, with the
+ * current state of the service.
+ * Returns -1 and sets errno on failure.
+ */
+int
+fsvstat_snapshot(fsvstat *h, struct fsvstat_info *info, size_t size)
+{
+	struct fsvstat_info i;
+	struct allinfo *ai = &h->last;
+
+	// what comes before this snapshot doesn't count as a change
+#ifdef __linux__
+	pthread_mutex_lock(&ino_mtx);
+	if (h->wd != -1)
+		ino_dispatch();
+	h->changed = 0;
+	pthread_mutex_unlock(&ino_mtx);
+#endif
+	if (fsvstat_raw(h, ai, sizeof(*ai)) == -1) {
+		h->have_last = 0;
+		return -1;
+	}
+	h->have_last = 1;
+
+	memset(&i, 0, sizeof(i));
+	i.version = FSVSTAT_VERSION;
+	i.pid = ai->fsv.pid;
+	i.since = ai->fsv.since;
+	i.gaveup = ai->fsv.gaveup;
+	proc_fill(&i.cmd, &ai->chld[0]);
+	proc_fill(&i.log, &ai->chld[1]);
+	i.od_state = ai->fsv.od_state;
+	i.od_activations = ai->fsv.od_activations;
+	i.rep_state = ai->fsv.rep_state;
+	i.rep_old = ai->fsv.rep_old;
+	i.replaces = ai->fsv.replaces;
+	i.lines = ai->sink.lines;
+	i.dropped = ai->sink.dropped;
+	i.backlog = ai->sink.backlog;
+	i.cpu = ai->chld[0].usage.cpu;
+	i.cpu_avg = ai->chld[0].usage.cpu_avg;
+	i.cpu_peak = ai->chld[0].usage.cpu_peak;
+	i.mem_kib = ai->chld[0].usage.mem_kib;
+	i.mem_avg_kib = ai->chld[0].usage.mem_avg_kib;
+	i.mem_peak_kib = ai->chld[0].usage.mem_peak_kib;
+
+	memset(info, 0, size);
+	memcpy(info, &i, size < sizeof(i) ? size : sizeof(i));
+	return 0;
+}
+
+/*
+ * An fd that becomes readable when the service changes, for poll(2) in
+ * an event loop; then call fsvstat_wait() with a timeout of 0.
+ * It is the same fd for all handles, so when it is readable, call that
+ * for each of them.
+ * Returns -1 if there is none, and fsvstat_wait() polls instead.
+ */
+int
+fsvstat_fd(const fsvstat *h)
+{
+	return h->wd != -1 ? ino_fd : -1;
+}
+
+/*
+ * Returns 0 if changes to the service are watched for, or the errno
+ * that kept them from being, like EMFILE or ENOSPC for the inotify
+ * limits, and fsvstat_wait() polls instead.
+ */
+int
+fsvstat_polling(const fsvstat *h)
+{
+	return h->wd != -1 ? 0 : h->ino_errno;
+}
+
+#ifdef __linux__
+static long
+ms_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 +
+	    (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+#endif
+
+/*
+ * Wait up to `timeout' ms, or forever if -1, for the service to change
+ * since the last snapshot.
+ * Returns 1 if it did, 0 if not, and -1 on error.
+ */
+int
+fsvstat_wait(fsvstat *h, int timeout)
+{
+#ifdef __linux__
+	struct timespec t0;
+
+	pthread_once(&ino_once, ino_cond_init);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&ino_mtx);
+	while (h->wd != -1) {
+		struct pollfd pfd[2] = {
+			{ ino_fd, POLLIN, 0 }, { ino_wake, POLLIN, 0 } };
+		int left = -1;
+		int r;
+
+		// another handle may have read its events already
+		ino_dispatch();
+		if (h->changed) {
+			h->changed = 0;
+			pthread_mutex_unlock(&ino_mtx);
+			return 1;
+		}
+		if (timeout != -1) {
+			left = timeout - ms_since(&t0);
+			if (left <= 0) {
+				pthread_mutex_unlock(&ino_mtx);
+				return 0;
+			}
+		}
+
+		// whoever polls hands the events out
+		if (ino_polling) {
+			if (timeout == -1) {
+				pthread_cond_wait(&ino_cond, &ino_mtx);
+			} else {
+				struct timespec dl = t0;
+				dl.tv_sec += timeout / 1000;
+				dl.tv_nsec += timeout % 1000 * 1000000;
+				if (dl.tv_nsec >= 1000000000) {
+					dl.tv_sec++;
+					dl.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&ino_cond, &ino_mtx,
+				    &dl);
+			}
+			continue;
+		}
+
+		ino_polling = 1;
+		pthread_mutex_unlock(&ino_mtx);
+		r = poll(pfd, 2, left);
+		pthread_mutex_lock(&ino_mtx);
+		ino_polling = 0;
+		if (pfd[1].revents & POLLIN) {
+			uint64_t n;
+			read(ino_wake, &n, sizeof(n));
+		}
+		// one of the others may poll now
+		pthread_cond_broadcast(&ino_cond);
+		if (r == -1 && errno != EINTR) {
+			pthread_mutex_unlock(&ino_mtx);
+			return -1;
+		}
+	}
+	// without a watch, or it went away along with the directory
+	pthread_mutex_unlock(&ino_mtx);
+#endif
+
+	for (int waited = 0; ; waited += FSVSTAT_POLL_MS) {
+		if (fsvstat_raw(h, &h->tmp, sizeof(h->tmp)) == 0 &&
+		    (!h->have_last ||
+		    memcmp(&h->tmp, &h->last, sizeof(h->last)) != 0))
+			return 1;
+		if (timeout != -1 && waited >= timeout)
+			return 0;
+		poll(NULL, 0, FSVSTAT_POLL_MS);
+	}
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Find the services of user `u', running or not.
+ * *namesp is set to their names, sorted; free with fsvstat_list_free().
+ * Returns how many there are, or -1 and sets errno.
+ */
+int
+fsvstat_list(uid_t u, char ***namesp)
+{
+	char **names = NULL;
+	int n = 0, cap = 0;
+	struct dirent *de;
+	char *dir;
+	DIR *d;
+
+	dir = state_dir(u);
+	if (dir == NULL)
+		return -1;
+	d = opendir(dir);
+	free(dir);
+	if (d == NULL)
+		return -1;
+
+	while ((de = readdir(d)) != NULL) {
+		struct stat st;
+		char *path;
+
+		if (de->d_name[0] == '.')
+			continue;
+		// only service directories have info.struct
+		if (asprintf(&path, "%s/info.struct", de->d_name) == -1)
+			goto fail;
+		if (fstatat(dirfd(d), path, &st, 0) == -1 ||
+		    !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		free(path);
+
+		if (n == cap) {
+			char **nn;
+			cap = cap ? cap * 2 : 64;
+			nn = realloc(names, cap * sizeof(*names));
+			if (nn == NULL)
+				goto fail;
+			names = nn;
+		}
+		if ((names[n] = strdup(de->d_name)) == NULL)
+			goto fail;
+		n++;
+	}
+	closedir(d);
+
+	if (n > 0)
+		qsort(names, n, sizeof(*names), name_cmp);
+	*namesp = names;
+	return n;
+
+fail:
+	closedir(d);
+	fsvstat_list_free(names, n);
+	errno = ENOMEM;
+	return -1;
+}
+
+void
+fsvstat_list_free(char **names, int n)
+{
+	for (int i=0; i<n; i++)
+		free(names[i]);
+	free(names);
+}
@@ -0,0 +1,110 @@
+#ifndef _FSVSTAT_H_
+#define _FSVSTAT_H_
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Reading the state of fsv services in-process.
+ *
+ * The structures here are the stable interface: fields are only ever
+ * added at the end, and callers pass the size of the structure they were
+ * compiled with, so that a newer library fills in only what an older
+ * caller knows about. struct fsvstat_proc sits inside fsvstat_info, so
+ * it grows into spare room of its own instead. `version' says what the
+ * library filled in, for a caller newer than it. The layout of
+ * info.struct itself is private to fsv and changes between versions.
+ */
+
+#define FSVSTAT_VERSION 3
+
+// on-demand states, from fsv --listen
+#define FSVSTAT_OD_OFF		0
+#define FSVSTAT_OD_IDLE		1
+#define FSVSTAT_OD_STARTING	2
+#define FSVSTAT_OD_ACTIVE	3
+
+// steps of a replace, from fsv --replace
+#define FSVSTAT_REP_NONE	0
+#define FSVSTAT_REP_STARTING	1
+#define FSVSTAT_REP_STOPPING	2
+#define FSVSTAT_REP_ABORTING	3
+
+// cmd or log
+struct fsvstat_proc {
+	// 0 if not running, -1 if never started
+	long pid;
+	// running or stopped since when, in CLOCK_REALTIME
+	struct timespec since;
+
+	long long total_execs;
+	long long recent_execs;
+	long long max_recent_execs;
+	long long recent_secs;
+
+	// 1 or 0 once it said it is ready, -1 without --ready-fd
+	int ready;
+	int frozen;
+	// waiting for admission, or held off by resource pressure
+	int queued;
+	int deferred;
+
+	// for fields to come; zero
+	long long spare[8];
+};
+
+struct fsvstat_info {
+	// FSVSTAT_VERSION of the library that filled this in
+	int version;
+
+	// fsv itself; pid is 0 if not running
+	long pid;
+	struct timespec since;
+	int gaveup;
+
+	struct fsvstat_proc cmd;
+	struct fsvstat_proc log;
+
+	int od_state;
+	long long od_activations;
+
+	int rep_state;
+	// the old cmd while both run
+	long rep_old;
+	long long replaces;
+
+	// the sink, if fsv looks at the output
+	long long lines;
+	long long dropped;
+	long long backlog;
+
+	// cmd's use, with fsv --sample; 0 without, or before a sample.
+	// CPU is in percent of one CPU, memory is resident
+	double cpu;
+	double cpu_avg;
+	double cpu_peak;
+	long long mem_kib;
+	double mem_avg_kib;
+	long long mem_peak_kib;
+};
+
+typedef struct fsvstat fsvstat;
+
+fsvstat *fsvstat_open(uid_t, const char *);
+void fsvstat_close(fsvstat *);
+const char *fsvstat_name(const fsvstat *);
+
+int fsvstat_snapshot(fsvstat *, struct fsvstat_info *, size_t);
+int fsvstat_fd(const fsvstat *);
+int fsvstat_polling(const fsvstat *);
+int fsvstat_wait(fsvstat *, int);
+
+int fsvstat_list(uid_t, char ***);
+void fsvstat_list_free(char **, int);
+
+// for fsv itself; the layout changes between versions
+int fsvstat_raw(fsvstat *, void *, size_t);
+
+#endif // !_FSVSTAT_H_
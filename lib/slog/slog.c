@@ -1,9 +1,18 @@
+#include <sys/uio.h>
+
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "slog.h"
 
@@ -13,64 +22,405 @@ static int do_stderr = 1;
 static int do_syslog = 0;
 
 /*
- * When printing to stderr, a %m specifier is only recognized at the end.
+ * Longest message printed to stderr, newline included;
+ * anything longer is cut short with "...".
+ */
+#define SLOG_MAX 2048
+
+/*
+ * Async mode, see slog_async().
+ *
+ * The ring is a bounded queue of fixed-size slots, with many producers
+ * and one consumer. A producer claims the slot at `tail' with a
+ * compare-and-swap, formats into it, then marks it full through its
+ * sequence number; a full ring makes it drop the message instead of
+ * waiting. The consumer is the flusher thread, or whoever calls
+ * slog_flush(); flush_mtx makes sure there is only one at a time.
+ * Producers never take a lock; they are counted in `inflight' so that
+ * slog_close() knows when the ring is no longer used.
+ */
+
+// messages written to stderr with one writev(2), at most
+#define SLOG_BATCH 64
+
+struct slot {
+	// pos for free, pos + 1 for full, where pos is the position of the
+	// slot in the ring the next time around
+	atomic_size_t seq;
+	int level;
+	int to_stderr;
+	int to_syslog;
+	// with the newline
+	int len;
+	char text[SLOG_MAX];
+};
+
+static atomic_int async;
+// callers of slog() that may be using the ring
+static atomic_int inflight;
+static struct slot *ring;
+static size_t ring_mask;
+static atomic_size_t tail;
+static size_t head;
+static atomic_ullong dropped;
+static unsigned long long dropped_told;
+
+static pthread_mutex_t flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static sem_t wake;
+static atomic_int stopping;
+static int atexit_done = 0;
+
+/*
+ * Copy `fmt' into `buf' of `size' bytes with each %m replaced by
+ * the message for `e', escaped for printf(3).
+ * If it doesn't fit, it is cut short with "...", but never in the
+ * middle of a conversion.
+ */
+static void
+expand_m(char *buf, size_t size, const char *fmt, int e)
+{
+	// keep room for the "..." and the NUL
+	size_t room = size - 4;
+	size_t n = 0;
+
+	for (const char *f = fmt; *f != '\0'; f++) {
+		size_t len;
+
+		if (f[0] == '%' && f[1] == 'm') {
+			for (const char *m = strerror(e); *m != '\0'; m++) {
+				if (n + 2 > room)
+					goto cut;
+				if (*m == '%')
+					buf[n++] = '%';
+				buf[n++] = *m;
+			}
+			f++;
+			continue;
+		}
+
+		// a conversion, %% included, goes whole or not at all
+		len = 1;
+		if (f[0] == '%') {
+			len += strspn(f + 1, "#0- +'123456789.*hlLqjzt");
+			if (f[len] != '\0')
+				len++;
+		}
+		if (n + len > room)
+			goto cut;
+		memcpy(buf + n, f, len);
+		n += len;
+		f += len - 1;
+	}
+	buf[n] = '\0';
+	return;
+
+cut:
+	memcpy(buf + n, "...", 4);
+}
+
+/*
+ * Format a message into `buf' of SLOG_MAX bytes, with a newline, without
+ * touching the heap, so that it works when memory has run out.
+ * %m may appear anywhere in the format, as with syslog(3).
+ * Returns the length, or -1.
+ */
+static int
+slog_format(char *buf, const char *fmt, va_list ap, int e)
+{
+	char xfmt[SLOG_MAX];
+	int n;
+
+	if (strstr(fmt, "%m") != NULL) {
+		expand_m(xfmt, sizeof(xfmt), fmt, e);
+		fmt = xfmt;
+	}
+
+	n = vsnprintf(buf, SLOG_MAX - 1, fmt, ap);
+	if (n < 0)
+		return -1;
+	if (n >= SLOG_MAX - 1) {
+		n = SLOG_MAX - 1;
+		memcpy(buf + n - 3, "...", 3);
+	}
+	buf[n++] = '\n';
+	return n;
+}
+
+/*
+ * Write all of `iov' to stderr, retrying on EINTR.
+ */
+static void
+write_all(struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t w = writev(STDERR_FILENO, iov, iovcnt);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+}
+
+/*
+ * Put a message in the ring for the flusher.
+ */
+static void
+slog_queue(int level, int to_stderr, const char *fmt, va_list ap, int e)
+{
+	size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	struct slot *s;
+
+	while (1) {
+		s = &ring[pos & ring_mask];
+		size_t seq = atomic_load_explicit(&s->seq,
+		    memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&tail, &pos,
+			    pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			// still full from the last time around
+			atomic_fetch_add_explicit(&dropped, 1,
+			    memory_order_relaxed);
+			return;
+		} else
+			pos = atomic_load_explicit(&tail,
+			    memory_order_relaxed);
+	}
+
+	s->level = level;
+	s->to_stderr = to_stderr;
+	s->to_syslog = do_syslog;
+	s->len = slog_format(s->text, fmt, ap, e);
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+	sem_post(&wake);
+}
+
+/*
+ * Write out what is in the ring; flush_mtx must be held.
+ */
+static void
+drain()
+{
+	struct iovec iov[SLOG_BATCH];
+	unsigned long long d;
+
+	while (1) {
+		int n, iovcnt = 0;
+
+		for (n = 0; n < SLOG_BATCH; n++) {
+			struct slot *s = &ring[(head + n) & ring_mask];
+			if (atomic_load_explicit(&s->seq,
+			    memory_order_acquire) != head + n + 1)
+				break;
+			if (s->to_stderr && s->len > 0) {
+				iov[iovcnt].iov_base = s->text;
+				iov[iovcnt].iov_len = s->len;
+				iovcnt++;
+			}
+		}
+		if (n == 0)
+			break;
+
+		write_all(iov, iovcnt);
+		for (int i=0; i<n; i++) {
+			struct slot *s = &ring[(head + i) & ring_mask];
+			if (s->to_syslog && s->len > 0)
+				syslog(s->level, "%.*s", s->len - 1, s->text);
+			atomic_store_explicit(&s->seq, head + i + ring_mask + 1,
+			    memory_order_release);
+		}
+		head += n;
+	}
+
+	d = atomic_load_explicit(&dropped, memory_order_relaxed);
+	if (d > dropped_told) {
+		char buf[SLOG_MAX];
+		int n = snprintf(buf, sizeof(buf),
+		    "slog: ring full, dropped %llu messages", d - dropped_told);
+		struct iovec v = { buf, n + 1 };
+
+		dropped_told = d;
+		buf[n] = '\n';
+		if (do_stderr && LOG_WARNING <= upto)
+			write_all(&v, 1);
+		if (do_syslog)
+			syslog(LOG_WARNING, "%.*s", n, buf);
+	}
+}
+
+static void *
+flusher_main(void *arg)
+{
+	while (!atomic_load(&stopping)) {
+		while (sem_wait(&wake) == -1 && errno == EINTR)
+			;
+		pthread_mutex_lock(&flush_mtx);
+		drain();
+		pthread_mutex_unlock(&flush_mtx);
+	}
+	return NULL;
+}
+
+/*
+ * The child of fork(2) has no flusher, and what is in the ring belongs
+ * to the parent.
+ */
+static void
+atfork_child()
+{
+	atomic_store(&async, 0);
+	pthread_mutex_init(&flush_mtx, NULL);
+}
+
+static void
+flush_atexit()
+{
+	slog_flush();
+}
+
+/*
  * Argument 'level' should be a level only, not OR'd with facility.
+ * errno is left as it was.
  */
 void
 slog(int level, const char *fmt, ...)
 {
+	int e = errno;
+	int to_stderr = do_stderr && level <= upto;
 	va_list ap;
 
-	if (do_stderr && level <= upto) {
-		va_start(ap, fmt);
-
-		/*
-		 * Determine if %m is there.
-		 */
-
-		int do_errno = 0;
-		size_t fmtlen = strlen(fmt) + 1;
-		char *fmtcpy = malloc(fmtlen);
-
-		if (fmtcpy == NULL) {
-			// malloc failed
-			do_errno = 0;
-		} else {
-			strcpy(fmtcpy, fmt);
-			if (fmtlen >= 3) {
-				// pointer to the last non-null character
-				char *p = fmtcpy + (fmtlen - 2);
-				if (*(p-1) == '%' && *p == 'm') {
-					// if fmt ended with "%m",
-					// NULL out both of those chars
-					*(p-1) = '\0';
-					*p = '\0';
-					do_errno = 1;
-				}
-			}
+	atomic_fetch_add(&inflight, 1);
+	if (atomic_load(&async)) {
+		if (to_stderr || do_syslog) {
+			va_start(ap, fmt);
+			slog_queue(level, to_stderr, fmt, ap, e);
+			va_end(ap);
 		}
+		atomic_fetch_sub(&inflight, 1);
+		errno = e;
+		return;
+	}
+	atomic_fetch_sub(&inflight, 1);
 
-		/*
-		 * Then print accordingly.
-		 */
-
-		if (do_errno) {
-			vfprintf(stderr, fmtcpy, ap);
-			fprintf(stderr, "%s", strerror(errno));
-			fprintf(stderr, "\n");
-		} else {
-			vfprintf(stderr, fmt, ap);
-			fprintf(stderr, "\n");
-		}
+	if (to_stderr) {
+		char buf[SLOG_MAX];
+		int n;
 
+		// one write(2), so that messages from several threads or
+		// processes don't interleave
+		va_start(ap, fmt);
+		n = slog_format(buf, fmt, ap, e);
 		va_end(ap);
+		if (n > 0) {
+			struct iovec v = { buf, n };
+			write_all(&v, 1);
+		}
 	}
 
 	if (do_syslog) {
 		va_start(ap, fmt);
+		errno = e;
 		vsyslog(level, fmt, ap);
 		va_end(ap);
 	}
+
+	errno = e;
+}
+
+/*
+ * Switch to async mode: slog() only formats the message into a ring of
+ * `slots' slots, rounded up to a power of two, and a thread writes it
+ * out, so that a slow syslogd or a stopped terminal doesn't hold up the
+ * caller. Messages that find the ring full are dropped and counted.
+ * Call after daemon(3), which the thread doesn't survive.
+ * Returns -1 and sets errno on failure, and stays synchronous then.
+ */
+int
+slog_async(int slots)
+{
+	size_t n = 1;
+	sigset_t all, old;
+	int e;
+
+	if (atomic_load(&async))
+		return 0;
+	if (slots < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (n < (size_t)slots)
+		n *= 2;
+
+	ring = malloc(n * sizeof(*ring));
+	if (ring == NULL)
+		return -1;
+	for (size_t i=0; i<n; i++)
+		atomic_init(&ring[i].seq, i);
+	ring_mask = n - 1;
+	atomic_store(&tail, 0);
+	head = 0;
+	atomic_store(&stopping, 0);
+	if (sem_init(&wake, 0, 0) == -1) {
+		free(ring);
+		return -1;
+	}
+
+	// all signals are for the other threads
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	e = pthread_create(&flusher, NULL, flusher_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (e != 0) {
+		sem_destroy(&wake);
+		free(ring);
+		errno = e;
+		return -1;
+	}
+
+	if (!atexit_done) {
+		pthread_atfork(NULL, NULL, atfork_child);
+		atexit(flush_atexit);
+		atexit_done = 1;
+	}
+	atomic_store_explicit(&async, 1, memory_order_release);
+	return 0;
+}
+
+/*
+ * Write out everything queued so far, in async mode.
+ */
+void
+slog_flush()
+{
+	if (!atomic_load(&async))
+		return;
+	pthread_mutex_lock(&flush_mtx);
+	drain();
+	pthread_mutex_unlock(&flush_mtx);
+}
+
+/*
+ * Messages dropped in async mode because the ring was full.
+ */
+unsigned long long
+slog_dropped()
+{
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
 }
 
 /*
@@ -100,9 +450,31 @@ slog_open(const char *ident, int logopt, int facil)
 
 	openlog(ident, logopt, facil);
 }
+
+/*
+ * In async mode, this also stops the thread after writing out everything,
+ * and goes back to synchronous mode.
+ */
 void
 slog_close()
 {
+	if (atomic_load(&async)) {
+		// from now on, slog() writes directly
+		atomic_store(&async, 0);
+		while (atomic_load(&inflight) > 0)
+			sched_yield();
+
+		atomic_store(&stopping, 1);
+		sem_post(&wake);
+		pthread_join(flusher, NULL);
+		pthread_mutex_lock(&flush_mtx);
+		drain();
+		pthread_mutex_unlock(&flush_mtx);
+
+		sem_destroy(&wake);
+		free(ring);
+		ring = NULL;
+	}
 	closelog();
 }
 
@@ -39,4 +39,8 @@ void slog_close();
 
 int slog_upto(int);
 
+int slog_async(int);
+void slog_flush();
+unsigned long long slog_dropped();
+
 #endif // !_SLOG_H_